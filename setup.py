@@ -50,6 +50,9 @@ setup(
             libraries=["tokyocabinet"],
             include_dirs=include_dirs,
             library_dirs=library_dirs
+        ),
+        Extension(
+            "tokyocabinet.keycodec", ['tokyocabinet/keycodec.c']
         )
     ],
     description = """tokyocabinet aims to be a complete python wrapper for the 
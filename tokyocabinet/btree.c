@@ -2,11 +2,33 @@
 #include <tcbdb.h>
 #include <tcutil.h>
 #include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 static PyObject *BTreeError;
 
 
+/*
+ * Bumped in the child after every fork(). A handle opened under an older
+ * generation shares file offsets, mappings and locks with the parent, so it
+ * is replaced by a fresh read-only handle the first time the child uses it.
+ */
+static volatile unsigned long btree_forkgen = 0;
+
+
+static void
+btree_atfork_child(void)
+{
+    btree_forkgen++;
+}
+
+
 static void
 raise_btree_error(TCBDB *db)
 {
@@ -24,15 +46,73 @@ raise_btree_error(TCBDB *db)
 }
 
 
+/*
+ * A composite comparator orders keys made of several fields, each compared
+ * with one of the builtin comparators in either direction. Fields are split
+ * on a delimiter byte or, when delim is -1, each is preceded by its length as
+ * a 4-byte big-endian integer. Whatever follows the last described field is
+ * compared lexically.
+ */
+typedef struct
+{
+    TCCMP cmp;
+    bool desc;
+} BTreeCmpField;
+
+typedef struct
+{
+    int delim;
+    int fnum;
+    BTreeCmpField fields[1];
+} BTreeCmpSpec;
+
+
 static PyTypeObject BTreeType;
 
 
+#define BTREE_PAGEIDSIZ 8
+#define BTREE_CACHEMIN 64
+#define BTREE_PAGESIZ 4096
+#define BTREE_PAGESIZMIN 256
+#define BTREE_NODEMISS 0.01
+
+
+typedef struct
+{
+    PY_LONG_LONG leaflookups;
+    PY_LONG_LONG leafloads;
+    PY_LONG_LONG leafouts;
+    PY_LONG_LONG nodelookups;
+    PY_LONG_LONG nodeloads;
+    PY_LONG_LONG nodeouts;
+} BTreeCacheCount;
+
+
 typedef struct
 {
     PyObject_HEAD
     TCBDB *db;
     PyObject *cmp;
     PyObject *cmpop;
+    BTreeCmpSpec *cmpspec;
+    PyObject *cmpfields;
+    int builtin;
+    bool mutex;
+    int lcnum, ncnum;
+    PY_LONG_LONG xmsiz;
+    char *path;
+    int omode;
+    unsigned long forkgen;
+    bool tran;
+    bool cachestats;
+    bool csynced;
+    TCMAP *lmirror;
+    TCMAP *nmirror;
+    PY_LONG_LONG cbudget;
+    int cinterval;
+    double cnodeshare;
+    BTreeCacheCount ctotal;
+    BTreeCacheCount cwindow;
 } BTree;
 
 
@@ -41,9 +121,21 @@ typedef struct
     PyObject_HEAD
     BTree *pydb;
     BDBCUR *cur;
+    unsigned long forkgen;
+    TCXSTR *kxstr;
+    TCXSTR *vxstr;
+    TCLIST *keys;
+    TCLIST *vals;
 } BTreeCursor;
 
 
+static int BTree_checkfork(BTree *self);
+
+
+/* How far a cursor steps forward before it jumps to a key instead. */
+#define BTREE_GETSTEPS 16
+
+
 static long
 BTreeCursor_Hash(PyObject *self)
 {
@@ -62,6 +154,22 @@ BTreeCursor_dealloc(BTreeCursor *self)
         tcbdbcurdel(self->cur);
         Py_END_ALLOW_THREADS
     }
+    if (self->kxstr)
+    {
+        tcxstrdel(self->kxstr);
+    }
+    if (self->vxstr)
+    {
+        tcxstrdel(self->vxstr);
+    }
+    if (self->keys)
+    {
+        tclistdel(self->keys);
+    }
+    if (self->vals)
+    {
+        tclistdel(self->vals);
+    }
     self->ob_type->tp_free(self);
 }
 
@@ -79,16 +187,26 @@ BTreeCursor_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         return NULL;
     }
     
-    if (PyArg_ParseTuple(args, "O!", &BTreeType, &pydb))
+    if (PyArg_ParseTuple(args, "O!", &BTreeType, &pydb) && !BTree_checkfork(pydb))
     {
         Py_INCREF(pydb);
         self->pydb = pydb;
+        self->forkgen = btree_forkgen;
+        
+        self->kxstr = tcxstrnew();
+        self->vxstr = tcxstrnew();
+        self->keys = tclistnew();
+        self->vals = tclistnew();
         
         self->cur = tcbdbcurnew(self->pydb->db);
         if (!self->cur)
         {
             raise_btree_error(self->pydb->db);
         }
+        else if (!self->kxstr || !self->vxstr || !self->keys || !self->vals)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Could not allocate cursor buffers");
+        }
         else
         {
             return (PyObject *) self;
@@ -100,6 +218,30 @@ BTreeCursor_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 }
 
 
+static int
+BTreeCursor_checkfork(BTreeCursor *self)
+{
+    if (self->forkgen != btree_forkgen)
+    {
+        PyErr_SetString(BTreeError,
+            "Cursor was created before fork(). Create a new one in this process.");
+        return -1;
+    }
+    return 0;
+}
+
+
+static PyObject *
+BTreeCursor_getattro(BTreeCursor *self, PyObject *name)
+{
+    if (BTreeCursor_checkfork(self))
+    {
+        return NULL;
+    }
+    return PyObject_GenericGetAttr((PyObject *) self, name);
+}
+
+
 static PyObject *
 BTreeCursor_first(BTreeCursor *self)
 {
@@ -297,38 +439,333 @@ static PyObject *
 BTreeCursor_rec(BTreeCursor *self)
 {
     bool success;
-    PyObject *tuple;
-    TCXSTR *key, *val;
     
-    key = tcxstrnew();
-    val = tcxstrnew();
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbcurrec(self->cur, self->kxstr, self->vxstr);
+    Py_END_ALLOW_THREADS
     
-    if (!key || !val)
+    if (!success)
     {
-        PyErr_SetString(PyExc_MemoryError, "Could not allocate TCXSTR object");
+        raise_btree_error(self->pydb->db);
+        return NULL;
+    }
+    
+    return Py_BuildValue("(s#s#)", tcxstrptr(self->kxstr), tcxstrsize(self->kxstr),
+        tcxstrptr(self->vxstr), tcxstrsize(self->vxstr));
+}
+
+
+/*
+ * Read up to n records starting at the current one, moving forwards or
+ * backwards. The cursor is left on the record after the last one returned.
+ */
+static PyObject *
+BTreeCursor_fetch(BTreeCursor *self, PyObject *args, PyObject *kwargs)
+{
+    int n, direction = 1;
+    int i, num, ksiz, vsiz, ecode = TCESUCCESS;
+    const char *kbuf, *vbuf;
+    PyObject *pylist, *tuple;
+    
+    static char *kwlist[] = {"n", "direction", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|i:fetch", kwlist,
+        &n, &direction))
+    {
+        return NULL;
+    }
+    
+    if (n < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected n to be non-negative.");
+        return NULL;
+    }
+    
+    if (direction != 1 && direction != -1)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected direction to be 1 or -1.");
+        return NULL;
     }
     
+    tclistclear(self->keys);
+    tclistclear(self->vals);
+    
     Py_BEGIN_ALLOW_THREADS
-    success = tcbdbcurrec(self->cur, key, val);
+    for (num=0; num<n; num++)
+    {
+        if (!tcbdbcurrec(self->cur, self->kxstr, self->vxstr))
+        {
+            ecode = tcbdbecode(self->pydb->db);
+            break;
+        }
+        tclistpush(self->keys, tcxstrptr(self->kxstr), tcxstrsize(self->kxstr));
+        tclistpush(self->vals, tcxstrptr(self->vxstr), tcxstrsize(self->vxstr));
+        
+        if (!(direction > 0 ? tcbdbcurnext(self->cur) : tcbdbcurprev(self->cur)))
+        {
+            ecode = tcbdbecode(self->pydb->db);
+            num++;
+            break;
+        }
+    }
     Py_END_ALLOW_THREADS
     
-    if (!success)
+    if (ecode != TCESUCCESS && ecode != TCENOREC)
     {
         raise_btree_error(self->pydb->db);
         return NULL;
     }
     
-    tuple = Py_BuildValue("(s#s#)", tcxstrptr(key), tcxstrsize(key),
-        tcxstrptr(val), tcxstrsize(val));
+    pylist = PyList_New(num);
+    if (!pylist)
+    {
+        return NULL;
+    }
+    
+    for (i=0; i<num; i++)
+    {
+        kbuf = tclistval(self->keys, i, &ksiz);
+        vbuf = tclistval(self->vals, i, &vsiz);
+        tuple = Py_BuildValue("(s#s#)", kbuf, ksiz, vbuf, vsiz);
+        if (!tuple)
+        {
+            Py_DECREF(pylist);
+            return NULL;
+        }
+        PyList_SET_ITEM(pylist, i, tuple);
+    }
+    
+    return pylist;
+}
+
+
+/*
+ * The cursor rests on the first record at or after each probe. When the
+ * next probe is close, it is reached by stepping forward from there, so
+ * neighbouring probes share a leaf instead of each descending from the root.
+ * After the call the cursor is on the record found for the last probe.
+ * The probes are copied first: the caller's list may change while the GIL
+ * is released.
+ */
+static PyObject *
+BTreeCursor_seek_each(BTreeCursor *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *probes, *fast, *key, *result = NULL, *recs, *tuple;
+    TCLIST *plist = NULL;
+    const char **pbufs = NULL;
+    const char *ckbuf, *kbuf, *vbuf;
+    int *psizs = NULL, *counts = NULL;
+    int take = 1, i, j, n, got, moved, step, cksiz, ksiz, vsiz, rv, rec;
+    bool valid, ok;
+    TCCMP cmp;
+    void *cmpop;
+    
+    static char *kwlist[] = {"keys", "take", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i:seek_each", kwlist,
+        &probes, &take))
+    {
+        return NULL;
+    }
+    
+    if (take < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected take to be at least 1.");
+        return NULL;
+    }
+    
+    fast = PySequence_Fast(probes, "Expected a sequence of keys.");
+    if (!fast)
+    {
+        return NULL;
+    }
+    
+    n = (int) PySequence_Fast_GET_SIZE(fast);
+    pbufs = (const char **) malloc((n + 1) * sizeof(char *));
+    psizs = (int *) malloc((n + 1) * sizeof(int));
+    counts = (int *) malloc((n + 1) * sizeof(int));
+    plist = tclistnew2(n + 1);
+    if (!pbufs || !psizs || !counts || !plist)
+    {
+        PyErr_NoMemory();
+        goto done;
+    }
+    
+    for (i=0; i<n; i++)
+    {
+        key = PySequence_Fast_GET_ITEM(fast, i);
+        if (!PyString_Check(key))
+        {
+            PyErr_SetString(PyExc_TypeError, "All keys must be strings.");
+            goto done;
+        }
+        tclistpush(plist, PyString_AS_STRING(key), (int) PyString_GET_SIZE(key));
+    }
+    
+    for (i=0; i<n; i++)
+    {
+        pbufs[i] = tclistval(plist, i, &psizs[i]);
+    }
+    
+    cmp = tcbdbcmpfunc(self->pydb->db);
+    cmpop = tcbdbcmpop(self->pydb->db);
+    tclistclear(self->keys);
+    tclistclear(self->vals);
+    
+    Py_BEGIN_ALLOW_THREADS
+    valid = false;
+    for (i=0; i<n; i++)
+    {
+        rv = -1;
+        if (valid && cmp(pbufs[i], psizs[i], pbufs[i - 1], psizs[i - 1], cmpop) >= 0)
+        {
+            for (step=0; valid && step<BTREE_GETSTEPS; step++)
+            {
+                ckbuf = tcbdbcurkey3(self->cur, &cksiz);
+                rv = ckbuf ? cmp(ckbuf, cksiz, pbufs[i], psizs[i], cmpop) : -1;
+                if (rv >= 0)
+                {
+                    break;
+                }
+                valid = tcbdbcurnext(self->cur);
+            }
+        }
+        if (!valid || rv < 0)
+        {
+            valid = tcbdbcurjump(self->cur, pbufs[i], psizs[i]);
+        }
+        
+        got = moved = 0;
+        ok = true;
+        while (valid && got < take && tcbdbcurrec(self->cur, self->kxstr, self->vxstr))
+        {
+            tclistpush(self->keys, tcxstrptr(self->kxstr), tcxstrsize(self->kxstr));
+            tclistpush(self->vals, tcxstrptr(self->vxstr), tcxstrsize(self->vxstr));
+            got++;
+            if (got < take)
+            {
+                if (!tcbdbcurnext(self->cur))
+                {
+                    ok = false;
+                    break;
+                }
+                moved++;
+            }
+        }
+        counts[i] = got;
+        
+        /* Go back to the record found for this probe. */
+        if (!ok)
+        {
+            valid = tcbdbcurjump(self->cur, pbufs[i], psizs[i]);
+        }
+        while (ok && moved-- > 0)
+        {
+            tcbdbcurprev(self->cur);
+        }
+    }
+    Py_END_ALLOW_THREADS
+    
+    result = PyList_New(n);
+    if (!result)
+    {
+        goto done;
+    }
+    
+    for (i=0, rec=0; i<n; i++)
+    {
+        recs = PyList_New(counts[i]);
+        if (!recs)
+        {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, i, recs);
+        
+        for (j=0; j<counts[i]; j++, rec++)
+        {
+            kbuf = tclistval(self->keys, rec, &ksiz);
+            vbuf = tclistval(self->vals, rec, &vsiz);
+            tuple = Py_BuildValue("(s#s#)", kbuf, ksiz, vbuf, vsiz);
+            if (!tuple)
+            {
+                Py_CLEAR(result);
+                goto done;
+            }
+            PyList_SET_ITEM(recs, j, tuple);
+        }
+    }
+    
+done:
+    if (plist)
+    {
+        tclistdel(plist);
+    }
+    free(counts);
+    free(psizs);
+    free(pbufs);
+    Py_DECREF(fast);
+    return result;
+}
+
+
+/* Iterating a cursor that is not on a record starts at the first record. */
+static PyObject *
+BTreeCursor_iter(BTreeCursor *self)
+{
+    if (BTreeCursor_checkfork(self))
+    {
+        return NULL;
+    }
+    
+    if (self->cur->id < 1)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        tcbdbcurfirst(self->cur);
+        Py_END_ALLOW_THREADS
+    }
+    
+    Py_INCREF(self);
+    return (PyObject *) self;
+}
+
+
+static PyObject *
+BTreeCursor_iternext(BTreeCursor *self)
+{
+    bool success;
+    int ecode = TCESUCCESS;
+    
+    if (BTreeCursor_checkfork(self))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbcurrec(self->cur, self->kxstr, self->vxstr);
+    if (success && !tcbdbcurnext(self->cur))
+    {
+        ecode = tcbdbecode(self->pydb->db);
+    }
+    Py_END_ALLOW_THREADS
     
-    tcxstrdel(key); tcxstrdel(val);
+    if (!success)
+    {
+        if (tcbdbecode(self->pydb->db) != TCENOREC)
+        {
+            raise_btree_error(self->pydb->db);
+        }
+        return NULL;
+    }
     
-    if (!tuple)
+    if (ecode != TCESUCCESS && ecode != TCENOREC)
     {
+        raise_btree_error(self->pydb->db);
         return NULL;
     }
     
-    return tuple;
+    return Py_BuildValue("(s#s#)", tcxstrptr(self->kxstr), tcxstrsize(self->kxstr),
+        tcxstrptr(self->vxstr), tcxstrsize(self->vxstr));
 }
 
 
@@ -394,6 +831,18 @@ static PyMethodDef BTreeCursor_methods[] =
         "Get the (key, value) tuple of the record at the current position."
     },
     
+    {
+        "fetch", (PyCFunction) BTreeCursor_fetch,
+        METH_VARARGS | METH_KEYWORDS,
+        "Get up to n (key, value) tuples from the current position on, moving in the given direction."
+    },
+    
+    {
+        "seek_each", (PyCFunction) BTreeCursor_seek_each,
+        METH_VARARGS | METH_KEYWORDS,
+        "For each of a sorted sequence of keys, get the first take (key, value) tuples at or after it."
+    },
+    
     { NULL }
 };
 
@@ -416,7 +865,7 @@ static PyTypeObject BTreeCursorType = {
   BTreeCursor_Hash,                            /* tp_hash  */
   0,                                           /* tp_call */
   0,                                           /* tp_str */
-  0,                                           /* tp_getattro */
+  (getattrofunc)BTreeCursor_getattro,          /* tp_getattro */
   0,                                           /* tp_setattro */
   0,                                           /* tp_as_buffer */
   Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,    /* tp_flags */
@@ -425,8 +874,8 @@ static PyTypeObject BTreeCursorType = {
   0,                                           /* tp_clear */
   0,                                           /* tp_richcompare */
   0,                                           /* tp_weaklistoffset */
-  0,                                           /* tp_iter */
-  0,                                           /* tp_iternext */
+  (getiterfunc)BTreeCursor_iter,               /* tp_iter */
+  (iternextfunc)BTreeCursor_iternext,          /* tp_iternext */
   BTreeCursor_methods,                         /* tp_methods */
   0,                                           /* tp_members */
   0,                                           /* tp_getset */
@@ -441,1118 +890,5375 @@ static PyTypeObject BTreeCursorType = {
 };
 
 
-static long
-BTree_Hash(PyObject *self)
+/*
+ * A walk steps a cursor through a key range in either direction, copying the
+ * current key (and optionally the value) into scratch buffers. Apart from
+ * btree_walkinit and btree_walkfree it never touches Python, so callers run
+ * it with the GIL released. A NULL bound leaves that end of the range open.
+ */
+typedef struct
 {
-    PyErr_SetString(PyExc_TypeError, "BTree objects are not hashable.");
-    return -1;
-}
+    BDBCUR *cur;
+    char *bkbuf;
+    int bksiz;
+    bool binc;
+    char *ekbuf;
+    int eksiz;
+    bool einc;
+    bool reverse;
+    bool started;
+    bool done;
+    TCCMP cmp;
+    void *cmpop;
+    TCXSTR *kxstr;
+    TCXSTR *vxstr;
+    uint64_t leaf;
+    int leaves;
+    int descents;
+} BTreeWalk;
 
 
 static void
-BTree_dealloc(BTree *self)
+btree_walkfree(BTreeWalk *walk)
 {
-    Py_XDECREF(self->cmp);
-    Py_XDECREF(self->cmpop);
-    if (self->db)
+    if (walk->cur)
     {
-        Py_BEGIN_ALLOW_THREADS
-        tcbdbdel(self->db);
-        Py_END_ALLOW_THREADS
+        tcbdbcurdel(walk->cur);
     }
-    self->ob_type->tp_free(self);
+    if (walk->kxstr)
+    {
+        tcxstrdel(walk->kxstr);
+    }
+    if (walk->vxstr)
+    {
+        tcxstrdel(walk->vxstr);
+    }
+    free(walk->bkbuf);
+    free(walk->ekbuf);
+    memset(walk, 0, sizeof(*walk));
 }
 
 
-static PyObject *
-BTree_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+/* Copy a range bound, which is either None or a string. */
+static int
+btree_parsebound(PyObject *obj, char **buf, int *siz)
 {
-    BTree *self;
+    *buf = NULL;
+    *siz = 0;
     
-    self = (BTree *) type->tp_alloc(type, 0);
-    if (!self)
+    if (!obj || obj == Py_None)
     {
-        PyErr_SetString(PyExc_MemoryError, "Cannot allocate BTree instance.");
-        return NULL;
+        return 0;
     }
     
-    self->cmp = self->cmpop = NULL;
-    
-    self->db = tcbdbnew();
-    if (!self->db)
+    if (!PyString_Check(obj))
     {
-        PyErr_SetString(PyExc_MemoryError, "Cannot allocate TCBDB instance.");
-        return NULL;
+        PyErr_SetString(PyExc_TypeError, "Expected range bounds to be strings or None.");
+        return -1;
     }
     
-    int omode = BDBOWRITER | BDBOCREAT;
-    char *path = NULL;
-    static char *kwlist[] = { "path", "omode", NULL };
-    
-    if (PyArg_ParseTupleAndKeywords(args, kwargs, "|si", kwlist, &path, &omode))
+    *siz = (int) PyString_GET_SIZE(obj);
+    *buf = (char *) malloc(*siz + 1);
+    if (!*buf)
     {
-        if (path)
-        {
-            bool success = 0;
-            Py_BEGIN_ALLOW_THREADS
-            success = tcbdbopen(self->db, path, omode);
-            Py_END_ALLOW_THREADS
-            if (success)
-            {
-                return (PyObject *) self;
-            }
-            raise_btree_error(self->db);
-        }
-        else
-        {
-            return (PyObject *) self;
-        }
+        PyErr_NoMemory();
+        return -1;
     }
-    
-    BTree_dealloc(self);
-    return NULL;
+    memcpy(*buf, PyString_AS_STRING(obj), *siz + 1);
+    return 0;
 }
 
 
-static PyObject *
-BTree_setmutex(BTree *self)
+static int
+btree_walkinit(BTreeWalk *walk, BTree *pydb, PyObject *start, PyObject *stop,
+    int binc, int einc, bool reverse)
 {
-    bool success = 0;
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbsetmutex(self->db);
-    Py_END_ALLOW_THREADS
-    if (!success)
+    memset(walk, 0, sizeof(*walk));
+    
+    if (btree_parsebound(start, &walk->bkbuf, &walk->bksiz) ||
+        btree_parsebound(stop, &walk->ekbuf, &walk->eksiz))
     {
-        raise_btree_error(self->db);
-        return NULL;
+        btree_walkfree(walk);
+        return -1;
     }
-    Py_RETURN_NONE;
+    
+    walk->binc = binc != 0;
+    walk->einc = einc != 0;
+    walk->reverse = reverse;
+    walk->cmp = tcbdbcmpfunc(pydb->db);
+    walk->cmpop = tcbdbcmpop(pydb->db);
+    walk->kxstr = tcxstrnew();
+    walk->vxstr = tcxstrnew();
+    
+    if (!walk->kxstr || !walk->vxstr)
+    {
+        btree_walkfree(walk);
+        PyErr_SetString(PyExc_MemoryError, "Could not allocate TCXSTR object");
+        return -1;
+    }
+    
+    walk->cur = tcbdbcurnew(pydb->db);
+    if (!walk->cur)
+    {
+        raise_btree_error(pydb->db);
+        btree_walkfree(walk);
+        return -1;
+    }
+    
+    return 0;
 }
 
 
-static int
-BTree_cmpfunc(const char *abuf, int asiz, const char *bbuf, int bsiz, BTree *self)
+static bool
+btree_walkread(BTreeWalk *walk, bool withval)
 {
-    int retval = 0;
-    PyObject *args, *result;
-    PyGILState_STATE gilstate;
+    const char *kbuf;
+    int ksiz;
     
-    args = Py_BuildValue("(s#s#O)", abuf, asiz, bbuf, bsiz, self->cmpop);
-    if (!args)
+    if (withval)
     {
-        /* PyThreadState_SetAsyncExc in main thread ?? */
-        return 0;
+        return tcbdbcurrec(walk->cur, walk->kxstr, walk->vxstr);
     }
     
-    gilstate = PyGILState_Ensure();
-    
-    result = PyEval_CallObject(self->cmp, args);
-    Py_DECREF(args);
-    
-    if (!result)
+    kbuf = tcbdbcurkey3(walk->cur, &ksiz);
+    if (!kbuf)
     {
-        /* Again...PyThreadState_SetAsyncExc? */
-        PyGILState_Release(gilstate);
-        return 0;
+        return false;
     }
-    
-    retval = PyLong_AsLong(result);
-    Py_DECREF(result);
-    PyGILState_Release(gilstate);
-    return retval;
+    tcxstrclear(walk->kxstr);
+    tcxstrcat(walk->kxstr, kbuf, ksiz);
+    return true;
 }
 
 
-static BDBCMP *BTree_builtin_cmp[] =
+static int
+btree_walkcmp(BTreeWalk *walk, const char *bound, int bsiz)
 {
-    NULL,
-    (BDBCMP *) &tcbdbcmplexical,
-    (BDBCMP *) &tcbdbcmpdecimal,
-    (BDBCMP *) &tcbdbcmpint32,
-    (BDBCMP *) &tcbdbcmpint64
-};
+    return walk->cmp(tcxstrptr(walk->kxstr), tcxstrsize(walk->kxstr), bound, bsiz, walk->cmpop);
+}
 
-static PyObject *
-BTree_setcmpfunc(BTree *self, PyObject *args, PyObject *kwargs)
+
+/* Whether the loaded key is still short of the far end of the range. */
+static bool
+btree_walkinrange(BTreeWalk *walk)
 {
-    int success = 0;
-    int builtin = -1;
-    PyObject *cmp, *cmpop;
-    static char *kwlist[] = { "cmp", "cmpop", "builtin", NULL };
+    int rv;
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOi:setcmpfunc", 
-        kwlist, &cmp, &cmpop, &builtin))
+    if (walk->reverse)
     {
-        return NULL;
+        if (!walk->bkbuf)
+        {
+            return true;
+        }
+        rv = btree_walkcmp(walk, walk->bkbuf, walk->bksiz);
+        return rv > 0 || (rv == 0 && walk->binc);
+    }
+    
+    if (!walk->ekbuf)
+    {
+        return true;
+    }
+    rv = btree_walkcmp(walk, walk->ekbuf, walk->eksiz);
+    return rv < 0 || (rv == 0 && walk->einc);
+}
+
+
+/*
+ * Move to the first record of the range on the first call and to the next
+ * one after that, loading its key (and value if withval). Returns false once
+ * the range is exhausted.
+ */
+static bool
+btree_walknext(BTreeWalk *walk, bool withval)
+{
+    bool ok;
+    
+    if (walk->done)
+    {
+        return false;
     }
     
-    if (builtin > 0)
+    if (walk->started)
     {
-        if (builtin > 4)
+        ok = walk->reverse ? tcbdbcurprev(walk->cur) : tcbdbcurnext(walk->cur);
+        ok = ok && btree_walkread(walk, withval);
+    }
+    else if (walk->reverse)
+    {
+        walk->started = true;
+        walk->descents += walk->ekbuf ? 1 : 0;
+        ok = walk->ekbuf ? tcbdbcurjumpback(walk->cur, walk->ekbuf, walk->eksiz) :
+            tcbdbcurlast(walk->cur);
+        ok = ok && btree_walkread(walk, withval);
+        while (ok && walk->ekbuf && !walk->einc &&
+            !btree_walkcmp(walk, walk->ekbuf, walk->eksiz))
         {
-            PyErr_SetString(BTreeError, 
-                "Expected 'builtin' to be one of CMPLEXICAL, CMPDECIMAL, CMPINT32, CMPINT64");
-            return NULL;
+            ok = tcbdbcurprev(walk->cur) && btree_walkread(walk, withval);
         }
-        
-        Py_BEGIN_ALLOW_THREADS
-        success = tcbdbsetcmpfunc(self->db, *BTree_builtin_cmp[builtin], NULL);
-        Py_END_ALLOW_THREADS
-        
-        if (!success)
+    }
+    else
+    {
+        walk->started = true;
+        walk->descents += walk->bkbuf ? 1 : 0;
+        ok = walk->bkbuf ? tcbdbcurjump(walk->cur, walk->bkbuf, walk->bksiz) :
+            tcbdbcurfirst(walk->cur);
+        ok = ok && btree_walkread(walk, withval);
+        while (ok && walk->bkbuf && !walk->binc &&
+            !btree_walkcmp(walk, walk->bkbuf, walk->bksiz))
         {
-            raise_btree_error(self->db);
-            return NULL;
+            ok = tcbdbcurnext(walk->cur) && btree_walkread(walk, withval);
         }
-        Py_RETURN_NONE;
     }
     
-    if (!PyCallable_Check(cmp))
+    /* Counted for the cache statistics; the cursor's id is its leaf. */
+    if (ok && walk->cur->id != walk->leaf)
     {
-        return NULL;
+        walk->leaf = walk->cur->id;
+        walk->leaves++;
     }
     
-    if (!cmpop)
+    if (!ok || !btree_walkinrange(walk))
     {
-        Py_INCREF(Py_None);
-        cmpop = Py_None;
+        walk->done = true;
+        return false;
     }
+    return true;
+}
+
+
+/*
+ * Tokyo Cabinet only counts cache activity in debug builds, so the counters
+ * are kept by mirroring the page ids of the leaf and node cache maps. Both
+ * maps are in LRU order: a page found in the cache moves to the tail, a page
+ * loaded from disk (or created by a split) is added at the tail and evicted
+ * pages leave from the head. After a call only the tail pages it could have
+ * touched are compared with the mirror, which costs time in proportion to
+ * the pages the call looked up rather than to the size of the cache. Pages
+ * loaded and evicted again within one call go unseen.
+ *
+ * Calls that are not counted (cursor methods, range, fwmkeys and the like)
+ * are caught when the mirror no longer matches the map; the next counted
+ * call then compares the whole cache and counts the difference. Handles
+ * shared between threads (setmutex) are never counted, since another thread
+ * may be changing the maps.
+ */
+static const char *
+btree_pageid(TCMAPREC *rec)
+{
+    /* The key follows the record header, see tcmapiterval. */
+    return (const char *) rec + sizeof(*rec);
+}
+
+
+static void
+btree_mirrorfull(TCMAP *mirror, TCMAP *map, PY_LONG_LONG *loads, PY_LONG_LONG *outs)
+{
+    TCMAPREC *rec;
+    uint64_t kept = 0;
+    int vsiz;
     
-    Py_INCREF(cmp);
-    Py_XINCREF(cmpop);
-    Py_XDECREF(self->cmp);
-    Py_XDECREF(self->cmpop);
-    
-    self->cmp = cmp;
-    self->cmpop = cmpop;
-    
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbsetcmpfunc(self->db, (BDBCMP) BTree_cmpfunc, self);
-    Py_END_ALLOW_THREADS
+    for (rec = map->first; rec; rec = rec->next)
+    {
+        if (tcmapget(mirror, btree_pageid(rec), BTREE_PAGEIDSIZ, &vsiz))
+        {
+            kept++;
+        }
+    }
+    *loads += tcmaprnum(map) - kept;
+    *outs += tcmaprnum(mirror) - kept;
     
-    if (!success)
+    tcmapclear(mirror);
+    for (rec = map->first; rec; rec = rec->next)
     {
-        raise_btree_error(self->db);
-        Py_DECREF(self->cmp);
-        Py_XDECREF(self->cmpop);
-        self->cmp = self->cmpop = NULL;
-        return NULL;
+        tcmapput(mirror, btree_pageid(rec), BTREE_PAGEIDSIZ, "", 0);
     }
-    Py_RETURN_NONE;
 }
 
 
-static PyObject *
-BTree_tune(BTree *self, PyObject *args, PyObject *kwargs)
+/* Bring the mirror in line with the last window pages of the map. */
+static void
+btree_mirrorsync(TCMAP *mirror, TCMAP *map, int window, PY_LONG_LONG *loads,
+    PY_LONG_LONG *outs)
 {
-    bool success = 0;
-    int lmemb, nmemb;
-    lmemb = nmemb = 0;
-    PY_LONG_LONG bnum = 0;
-    short apow, bpow;
-    apow = bpow = -1;
-    unsigned char opts = 0;
-    
-    static char *kwlist[] = {"lmemb", "nmemb", "bnum", "apow", "bpow", "opts", NULL };
+    TCMAPREC *rec;
+    char id[BTREE_PAGEIDSIZ];
+    int i, vsiz;
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iiLhhB:tune", kwlist, 
-        &lmemb, &nmemb, &bnum, &apow, &bpow, &opts))
+    /* Replay the tail in order: found pages move to the tail, new ones are added. */
+    rec = map->last;
+    for (i=1; rec && rec->prev && i<window; i++)
     {
-        return NULL;
+        rec = rec->prev;
     }
-    
-    if (apow < SCHAR_MIN || apow > SCHAR_MAX ||
-        bpow < SCHAR_MIN || bpow > SCHAR_MAX)
+    for (; rec; rec = rec->next)
     {
-        return NULL;
+        if (!tcmapget3(mirror, btree_pageid(rec), BTREE_PAGEIDSIZ, &vsiz))
+        {
+            tcmapput(mirror, btree_pageid(rec), BTREE_PAGEIDSIZ, "", 0);
+            (*loads)++;
+        }
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbtune(self->db, lmemb, nmemb, bnum, apow, bpow, opts);
-    Py_END_ALLOW_THREADS
+    /* The pages left of the old order are now at the head, evicted ones first. */
+    while (mirror->first)
+    {
+        memcpy(id, btree_pageid(mirror->first), BTREE_PAGEIDSIZ);
+        if (tcmapget(map, id, BTREE_PAGEIDSIZ, &vsiz))
+        {
+            break;
+        }
+        tcmapout(mirror, id, BTREE_PAGEIDSIZ);
+        (*outs)++;
+    }
     
-    if (!success)
+    if (tcmaprnum(mirror) != tcmaprnum(map) || (map->first &&
+        memcmp(btree_pageid(mirror->first), btree_pageid(map->first), BTREE_PAGEIDSIZ)))
     {
-        raise_btree_error(self->db);
-        return NULL;
+        btree_mirrorfull(mirror, map, loads, outs);
     }
-    Py_RETURN_NONE;
 }
 
 
-static PyObject *
-BTree_setcache(BTree *self, PyObject *args, PyObject *kwargs)
+/*
+ * Split the budget between the node and leaf caches, favouring nodes while
+ * they miss. Without setmutex a handle is used by one thread at a time, so
+ * with the GIL held nothing else is inside Tokyo Cabinet on it and the new
+ * capacities can be written to the handle directly. tcbdbsetcache refuses
+ * to run on an open handle; Tokyo Cabinet trims to the new sizes after the
+ * next operation.
+ */
+static void
+btree_cacheadapt(BTree *self)
 {
-    bool success = 0;
-    int lcnum, ncnum;
-    lcnum = ncnum = 0;
+    TCBDB *db = self->db;
+    BTreeCacheCount *win = &self->cwindow;
+    uint64_t lnum, nnum, fsiz;
+    double pagesiz, pages, lcnum, ncnum;
     
-    static char *kwlist[] = {"lcnum", "ncnum", NULL};
+    if (self->mutex || !db->leafc || !db->nodec)
+    {
+        return;
+    }
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ii", kwlist, &lcnum, &ncnum))
+    lnum = tcbdblnum(db);
+    nnum = tcbdbnnum(db);
+    fsiz = tcbdbfsiz(db);
+    
+    pagesiz = lnum + nnum > 0 ? (double) fsiz / (lnum + nnum) : BTREE_PAGESIZ;
+    if (pagesiz < BTREE_PAGESIZMIN)
     {
-        return NULL;
+        pagesiz = BTREE_PAGESIZMIN;
     }
+    pages = self->cbudget / pagesiz;
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbsetcache(self->db, lcnum, ncnum);
-    Py_END_ALLOW_THREADS
+    if (win->nodelookups > 0)
+    {
+        if ((double) win->nodeloads / win->nodelookups > BTREE_NODEMISS && self->cnodeshare < 0.5)
+        {
+            self->cnodeshare += 0.05;
+        }
+        else if (!win->nodeloads && tcmaprnum(db->nodec) < db->ncnum && self->cnodeshare > 0.1)
+        {
+            self->cnodeshare -= 0.05;
+        }
+    }
     
-    if (!success)
+    /* Capacity beyond the number of pages in the file is never used. */
+    ncnum = pages * self->cnodeshare;
+    if (ncnum > nnum + BTREE_CACHEMIN)
     {
-        raise_btree_error(self->db);
-        return NULL;
+        ncnum = nnum + BTREE_CACHEMIN;
     }
-    Py_RETURN_NONE;
+    lcnum = pages - ncnum;
+    if (lcnum > lnum + BTREE_CACHEMIN)
+    {
+        lcnum = lnum + BTREE_CACHEMIN;
+    }
+    
+    self->lcnum = lcnum < BTREE_CACHEMIN ? BTREE_CACHEMIN : lcnum > INT_MAX ? INT_MAX : (int) lcnum;
+    self->ncnum = ncnum < BTREE_CACHEMIN ? BTREE_CACHEMIN : ncnum > INT_MAX ? INT_MAX : (int) ncnum;
+    db->lcnum = self->lcnum;
+    db->ncnum = self->ncnum;
+    
+    memset(win, 0, sizeof(*win));
 }
 
 
-static PyObject *
-BTree_setxmsize(BTree *self, PyObject *args)
+/* Whether to count the next call; the mirror is filled first if it is stale. */
+static bool
+btree_probebegin(BTree *self)
 {
-    bool success = 0;
-    PY_LONG_LONG xmsiz = 0;
+    TCBDB *db = self->db;
+    PY_LONG_LONG ignored = 0;
     
-    if (!PyArg_ParseTuple(args, "L", &xmsiz))
+    if (!self->cachestats || self->mutex || !db->leafc || !db->nodec)
     {
-        return NULL;
+        return false;
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbsetxmsiz(self->db, xmsiz);
-    Py_END_ALLOW_THREADS
-    
-    if (!success)
+    if (!self->csynced)
     {
-        raise_btree_error(self->db);
-        return NULL;
+        btree_mirrorfull(self->lmirror, db->leafc, &ignored, &ignored);
+        btree_mirrorfull(self->nmirror, db->nodec, &ignored, &ignored);
+        self->csynced = true;
+        if (self->cbudget > 0)
+        {
+            btree_cacheadapt(self);
+        }
     }
-    Py_RETURN_NONE;
+    return true;
 }
 
 
-static PyObject *
-BTree_open(BTree *self, PyObject *args, PyObject *kwargs)
+/*
+ * Count a call that looked up the given number of leaves and descended from
+ * the root descents times, each descent costing one lookup per level of
+ * nodes. A descent is skipped when the key is on the leaf Tokyo Cabinet
+ * used last, so node lookups are an upper bound. The windows also cover
+ * the pages a split may have added.
+ */
+static void
+btree_probeend(BTree *self, bool probe, int leaves, int descents)
 {
-    int omode = BDBOWRITER | BDBOCREAT;
-    char *path = NULL;
-    static char *kwlist[] = { "path", "omode", NULL };
+    TCBDB *db = self->db;
+    BTreeCacheCount c;
     
-    if (PyArg_ParseTupleAndKeywords(args, kwargs, "s|i:open", kwlist, &path, &omode))
+    if (!probe || !db->leafc || !db->nodec)
     {
-        bool success = 0;
-        Py_BEGIN_ALLOW_THREADS
-        success = tcbdbopen(self->db, path, omode);
-        Py_END_ALLOW_THREADS
-        if (success)
+        return;
+    }
+    
+    memset(&c, 0, sizeof(c));
+    c.leaflookups = leaves;
+    c.nodelookups = (PY_LONG_LONG) descents * db->hnum;
+    btree_mirrorsync(self->lmirror, db->leafc, leaves + descents + 2, &c.leafloads, &c.leafouts);
+    btree_mirrorsync(self->nmirror, db->nodec, (int) c.nodelookups + db->hnum + 2,
+        &c.nodeloads, &c.nodeouts);
+    
+    self->ctotal.leaflookups += c.leaflookups;
+    self->ctotal.leafloads += c.leafloads;
+    self->ctotal.leafouts += c.leafouts;
+    self->ctotal.nodelookups += c.nodelookups;
+    self->ctotal.nodeloads += c.nodeloads;
+    self->ctotal.nodeouts += c.nodeouts;
+    
+    if (self->cbudget > 0)
+    {
+        self->cwindow.leaflookups += c.leaflookups;
+        self->cwindow.nodelookups += c.nodelookups;
+        self->cwindow.nodeloads += c.nodeloads;
+        if (self->cwindow.leaflookups >= self->cinterval)
         {
-            Py_RETURN_NONE;
+            btree_cacheadapt(self);
         }
-        raise_btree_error(self->db);
     }
-    return NULL;
 }
 
 
-static PyObject *
-BTree_close(BTree *self)
+/* Count the pages a walk went through since the last call. */
+static void
+btree_probewalk(BTree *self, bool probe, BTreeWalk *walk)
 {
-    bool success = 0;
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbclose(self->db);
-    Py_END_ALLOW_THREADS
-    if (!success)
-    {
-        raise_btree_error(self->db);
-        return NULL;
-    }
-    Py_RETURN_NONE;
+    btree_probeend(self, probe, walk->leaves, walk->descents);
+    walk->leaves = walk->descents = 0;
 }
 
 
-static PyObject *
-BTree_put(BTree *self, PyObject *args)
+#define BTREE_ITERKEYS 1
+#define BTREE_ITERVALUES 2
+#define BTREE_ITERITEMS 3
+
+
+typedef struct
 {
-    bool success;
-    char *kbuf, *vbuf;
-    int ksiz, vsiz;
-    
-    if (!PyArg_ParseTuple(args, "s#s#:put", &kbuf, &ksiz, &vbuf, &vsiz))
-    {
-        return NULL;
-    }
-    
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbput(self->db, kbuf, ksiz, vbuf, vsiz);
-    Py_END_ALLOW_THREADS
-    
-    if (!success)
+    PyObject_HEAD
+    BTree *pydb;
+    BTreeWalk walk;
+    int mode;
+    int batch;
+    TCLIST *keys;
+    TCLIST *vals;
+    int pos;
+    int num;
+    PY_LONG_LONG skip;
+    PY_LONG_LONG left;
+    unsigned long forkgen;
+    bool busy;
+} BTreeRangeIter;
+
+
+static void
+BTreeRangeIter_dealloc(BTreeRangeIter *self)
+{
+    btree_walkfree(&self->walk);
+    if (self->keys)
     {
-        raise_btree_error(self->db);
-        return NULL;
+        tclistdel(self->keys);
     }
-    Py_RETURN_NONE;
+    if (self->vals)
+    {
+        tclistdel(self->vals);
+    }
+    Py_XDECREF((PyObject *) self->pydb);
+    self->ob_type->tp_free(self);
 }
 
 
-static PyObject *
-BTree_putkeep(BTree *self, PyObject *args)
+/* Read the next batch of records with the GIL released. */
+static bool
+BTreeRangeIter_fill(BTreeRangeIter *self)
 {
-    bool success;
-    char *kbuf, *vbuf;
-    int ksiz, vsiz;
+    int n = 0;
+    bool withkey = self->mode != BTREE_ITERVALUES;
+    bool withval = self->mode != BTREE_ITERKEYS;
+    bool probe;
+    BTreeWalk *walk = &self->walk;
     
-    if (!PyArg_ParseTuple(args, "s#s#:putkeep", &kbuf, &ksiz, &vbuf, &vsiz))
-    {
-        return NULL;
-    }
+    tclistclear(self->keys);
+    tclistclear(self->vals);
     
+    probe = btree_probebegin(self->pydb);
     Py_BEGIN_ALLOW_THREADS
-    success = tcbdbputkeep(self->db, kbuf, ksiz, vbuf, vsiz);
-    Py_END_ALLOW_THREADS
-    
-    if (!success)
+    while (self->skip > 0 && btree_walknext(walk, false))
     {
-        raise_btree_error(self->db);
-        return NULL;
+        self->skip--;
     }
-    Py_RETURN_NONE;
+    while (n < self->batch && self->left != 0 && btree_walknext(walk, withval))
+    {
+        if (withkey)
+        {
+            tclistpush(self->keys, tcxstrptr(walk->kxstr), tcxstrsize(walk->kxstr));
+        }
+        if (withval)
+        {
+            tclistpush(self->vals, tcxstrptr(walk->vxstr), tcxstrsize(walk->vxstr));
+        }
+        if (self->left > 0)
+        {
+            self->left--;
+        }
+        n++;
+    }
+    Py_END_ALLOW_THREADS
+    btree_probewalk(self->pydb, probe, walk);
+    
+    self->pos = 0;
+    self->num = n;
+    return n > 0;
 }
 
 
 static PyObject *
-BTree_putcat(BTree *self, PyObject *args)
+BTreeRangeIter_iternext(BTreeRangeIter *self)
 {
-    bool success;
-    char *kbuf, *vbuf;
     int ksiz, vsiz;
+    const char *kbuf, *vbuf;
     
-    if (!PyArg_ParseTuple(args, "s#s#:putcat", &kbuf, &ksiz, &vbuf, &vsiz))
+    if (self->forkgen != btree_forkgen)
     {
+        PyErr_SetString(BTreeError,
+            "Iterator was created before fork(). Create a new one in this process.");
         return NULL;
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbputcat(self->db, kbuf, ksiz, vbuf, vsiz);
-    Py_END_ALLOW_THREADS
-    
-    if (!success)
+    /* Another thread is filling a batch with the GIL released. */
+    if (self->busy)
     {
-        raise_btree_error(self->db);
+        PyErr_SetString(PyExc_ValueError, "iterator already executing");
         return NULL;
     }
-    Py_RETURN_NONE;
-}
-
-
-static PyObject *
-BTree_putdup(BTree *self, PyObject *args)
-{
-    bool success;
-    char *kbuf, *vbuf;
-    int ksiz, vsiz;
     
-    if (!PyArg_ParseTuple(args, "s#s#:putdup", &kbuf, &ksiz, &vbuf, &vsiz))
+    if (self->pos >= self->num)
     {
-        return NULL;
+        bool more;
+        
+        self->busy = true;
+        more = BTreeRangeIter_fill(self);
+        self->busy = false;
+        if (!more)
+        {
+            return NULL;
+        }
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbputdup(self->db, kbuf, ksiz, vbuf, vsiz);
-    Py_END_ALLOW_THREADS
-    
-    if (!success)
+    switch (self->mode)
     {
-        raise_btree_error(self->db);
-        return NULL;
+        case BTREE_ITERKEYS:
+            kbuf = tclistval(self->keys, self->pos++, &ksiz);
+            return PyString_FromStringAndSize(kbuf, ksiz);
+        
+        case BTREE_ITERVALUES:
+            vbuf = tclistval(self->vals, self->pos++, &vsiz);
+            return PyString_FromStringAndSize(vbuf, vsiz);
+        
+        default:
+            kbuf = tclistval(self->keys, self->pos, &ksiz);
+            vbuf = tclistval(self->vals, self->pos++, &vsiz);
+            return Py_BuildValue("(s#s#)", kbuf, ksiz, vbuf, vsiz);
     }
-    Py_RETURN_NONE;
 }
 
 
+static PyTypeObject BTreeRangeIterType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                                           /* ob_size */
+  "tokyocabinet.btree.BTreeRangeIter",         /* tp_name */
+  sizeof(BTreeRangeIter),                      /* tp_basicsize */
+  0,                                           /* tp_itemsize */
+  (destructor)BTreeRangeIter_dealloc,          /* tp_dealloc */
+  0,                                           /* tp_print */
+  0,                                           /* tp_getattr */
+  0,                                           /* tp_setattr */
+  0,                                           /* tp_compare */
+  0,                                           /* tp_repr */
+  0,                                           /* tp_as_number */
+  0,                                           /* tp_as_sequence */
+  0,                                           /* tp_as_mapping */
+  0,                                           /* tp_hash  */
+  0,                                           /* tp_call */
+  0,                                           /* tp_str */
+  0,                                           /* tp_getattro */
+  0,                                           /* tp_setattro */
+  0,                                           /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                          /* tp_flags */
+  "Lazy iterator over a BTree key range",      /* tp_doc */
+  0,                                           /* tp_traverse */
+  0,                                           /* tp_clear */
+  0,                                           /* tp_richcompare */
+  0,                                           /* tp_weaklistoffset */
+  PyObject_SelfIter,                           /* tp_iter */
+  (iternextfunc)BTreeRangeIter_iternext,       /* tp_iternext */
+  0,                                           /* tp_methods */
+};
+
+
+/* Create a range iterator. Called with the GIL held on a fork-checked handle. */
 static PyObject *
-BTree_out(BTree *self, PyObject *args)
+btree_rangeiternew(BTree *pydb, PyObject *start, PyObject *stop, int binc, int einc,
+    bool reverse, int mode, int batch)
 {
-    bool success;
-    char *kbuf;
-    int ksiz;
+    BTreeRangeIter *self;
     
-    if (!PyArg_ParseTuple(args, "s#:out", &kbuf, &ksiz))
+    if (batch < 1)
     {
+        PyErr_SetString(PyExc_ValueError, "Expected batch to be at least 1.");
         return NULL;
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbout(self->db, kbuf, ksiz);
-    Py_END_ALLOW_THREADS
+    self = PyObject_New(BTreeRangeIter, &BTreeRangeIterType);
+    if (!self)
+    {
+        return NULL;
+    }
     
-    if (!success)
+    Py_INCREF(pydb);
+    self->pydb = pydb;
+    self->mode = mode;
+    self->batch = batch;
+    self->pos = self->num = 0;
+    self->skip = 0;
+    self->left = -1;
+    self->forkgen = btree_forkgen;
+    self->busy = false;
+    self->keys = tclistnew();
+    self->vals = tclistnew();
+    
+    if (btree_walkinit(&self->walk, pydb, start, stop, binc, einc, reverse))
+    {
+        memset(&self->walk, 0, sizeof(self->walk));
+        Py_DECREF(self);
+        return NULL;
+    }
+    
+    if (!self->keys || !self->vals)
     {
-        raise_btree_error(self->db);
+        Py_DECREF(self);
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memory for TCLIST object");
         return NULL;
     }
-    Py_RETURN_NONE;
+    
+    return (PyObject *) self;
 }
 
 
-static PyObject *
-BTree_outdup(BTree *self, PyObject *args)
+static long
+BTree_Hash(PyObject *self)
 {
-    bool success;
-    char *kbuf;
-    int ksiz;
-    
-    if (!PyArg_ParseTuple(args, "s#:outdup", &kbuf, &ksiz))
+    PyErr_SetString(PyExc_TypeError, "BTree objects are not hashable.");
+    return -1;
+}
+
+
+static void
+BTree_dealloc(BTree *self)
+{
+    Py_XDECREF(self->cmp);
+    Py_XDECREF(self->cmpop);
+    Py_XDECREF(self->cmpfields);
+    /* A handle inherited across fork() is left alone, see BTree_reopen. */
+    if (self->db && self->forkgen == btree_forkgen)
     {
-        return NULL;
+        Py_BEGIN_ALLOW_THREADS
+        tcbdbdel(self->db);
+        Py_END_ALLOW_THREADS
     }
-    
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbout3(self->db, kbuf, ksiz);
-    Py_END_ALLOW_THREADS
-    
-    if (!success)
+    if (self->lmirror)
     {
-        raise_btree_error(self->db);
-        return NULL;
+        tcmapdel(self->lmirror);
     }
-    Py_RETURN_NONE;
+    if (self->nmirror)
+    {
+        tcmapdel(self->nmirror);
+    }
+    free(self->cmpspec);
+    free(self->path);
+    self->ob_type->tp_free(self);
 }
 
 
-static PyObject *
-BTree_get(BTree *self, PyObject *args, PyObject *kwargs)
+static void
+BTree_setopened(BTree *self, const char *path, int omode)
 {
-    char *kbuf, *vbuf;
-    int ksiz, vsiz;
-    PyObject *default_value = NULL;
-    PyObject *value = NULL;
+    free(self->path);
+    self->path = path ? strdup(path) : NULL;
+    self->omode = path ? omode : 0;
+    self->tran = false;
+    self->csynced = false;
+}
+
+
+/*
+ * Replace a handle inherited from the parent process with a new read-only
+ * handle on the same file. The inherited TCBDB is deliberately leaked:
+ * closing it would flush and unlock on the parent's behalf, and its mutexes
+ * may have been held by a parent thread that does not exist in the child.
+ */
+static bool
+BTree_reopen(BTree *self)
+{
+    bool success;
+    int omode;
+    TCBDB *db, *old;
     
-    static char *kwlist[] = {"key", "default", NULL};
+    old = self->db;
+    self->forkgen = btree_forkgen;
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|O:outdup", kwlist, &kbuf, &ksiz, &default_value))
+    db = tcbdbnew();
+    if (!db)
     {
-        return NULL;
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate TCBDB instance.");
+        return false;
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    vbuf = tcbdbget(self->db, kbuf, ksiz, &vsiz);
-    Py_END_ALLOW_THREADS
-    
-    if (!vbuf)
+    if (self->mutex)
     {
-        if (default_value)
-        {
-            return default_value;
-        }
-        Py_RETURN_NONE;
+        tcbdbsetmutex(db);
     }
-    
-    value = PyString_FromStringAndSize(vbuf, vsiz);
-    free(vbuf);
-    
-    if (!value)
+    tcbdbsetcmpfunc(db, tcbdbcmpfunc(old), tcbdbcmpop(old));
+    if (self->lcnum || self->ncnum)
     {
-        return NULL;
+        tcbdbsetcache(db, self->lcnum, self->ncnum);
     }
+    if (self->xmsiz)
+    {
+        tcbdbsetxmsiz(db, self->xmsiz);
+    }
+    self->db = db;
     
-    return value;
-}
-
-
-static PyObject *
-BTree_getdup(BTree *self, PyObject *args)
-{
-    char *kbuf;
-    int ksiz, i, n;
-    PyObject *pylist;
-    TCLIST *list;
-    
-    if (!PyArg_ParseTuple(args, "s#:getdup", &kbuf, &ksiz))
+    if (!self->path)
     {
-        return NULL;
+        return true;
     }
     
+    /*
+     * Never wait for the lock: a writer in the parent holds it for as long as
+     * its handle is open, and the child would block on its first access.
+     */
+    omode = BDBOREADER | BDBOLCKNB | (self->omode & BDBONOLCK);
+    
     Py_BEGIN_ALLOW_THREADS
-    list = tcbdbget4(self->db, kbuf, ksiz);
+    success = tcbdbopen(db, self->path, omode);
     Py_END_ALLOW_THREADS
     
-    if (!list)
+    if (!success)
     {
-        raise_btree_error(self->db);
-        return NULL;
+        PyErr_Format(BTreeError,
+            "Could not reopen %s read-only after fork(): %s. Writer handles cannot "
+            "be used across fork(); open the database again in this process.",
+            self->path, tcbdberrmsg(tcbdbecode(db)));
+        BTree_setopened(self, NULL, 0);
+        return false;
     }
     
-    n = tclistnum(list);
-    pylist = PyList_New(n);
-    if (pylist)
+    self->omode = omode;
+    return true;
+}
+
+
+static int
+BTree_checkfork(BTree *self)
+{
+    if (self->forkgen != btree_forkgen && !BTree_reopen(self))
     {
-        for (i=0; i<n; i++)
-        {
-            int vsiz;
-            const char *vbuf;
-            PyObject *value;
-            
-            vbuf = tclistval(list, i, &vsiz);
-            value = PyString_FromStringAndSize(vbuf, vsiz);
-            PyList_SET_ITEM(pylist, i, value);
-        }
+        return -1;
     }
-    tclistdel(list);
-    
-    return pylist;
+    return 0;
 }
 
 
 static PyObject *
-BTree_vnum(BTree *self, PyObject *args)
+BTree_getattro(BTree *self, PyObject *name)
 {
-    char *kbuf;
-    int ksiz, vnum;
-    
-    if (!PyArg_ParseTuple(args, "s#:vnum", &kbuf, &ksiz))
+    if (BTree_checkfork(self))
     {
         return NULL;
     }
-    
-    Py_BEGIN_ALLOW_THREADS
-    vnum = tcbdbvnum(self->db, kbuf, ksiz);
-    Py_END_ALLOW_THREADS
-    
-    return Py_BuildValue("i", vnum);
+    return PyObject_GenericGetAttr((PyObject *) self, name);
 }
 
 
 static PyObject *
-BTree_vsiz(BTree *self, PyObject *args)
+BTree_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 {
-    char *kbuf;
-    int ksiz, vsiz;
+    BTree *self;
     
-    if (!PyArg_ParseTuple(args, "s#:vsiz", &kbuf, &ksiz))
+    self = (BTree *) type->tp_alloc(type, 0);
+    if (!self)
     {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate BTree instance.");
         return NULL;
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    vsiz = tcbdbvsiz(self->db, kbuf, ksiz);
+    self->cmp = self->cmpop = NULL;
+    self->forkgen = btree_forkgen;
+    
+    self->db = tcbdbnew();
+    if (!self->db)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate TCBDB instance.");
+        return NULL;
+    }
+    
+    int omode = BDBOWRITER | BDBOCREAT;
+    char *path = NULL;
+    static char *kwlist[] = { "path", "omode", NULL };
+    
+    if (PyArg_ParseTupleAndKeywords(args, kwargs, "|si", kwlist, &path, &omode))
+    {
+        if (path)
+        {
+            bool success = 0;
+            Py_BEGIN_ALLOW_THREADS
+            success = tcbdbopen(self->db, path, omode);
+            Py_END_ALLOW_THREADS
+            if (success)
+            {
+                BTree_setopened(self, path, omode);
+                return (PyObject *) self;
+            }
+            raise_btree_error(self->db);
+        }
+        else
+        {
+            return (PyObject *) self;
+        }
+    }
+    
+    BTree_dealloc(self);
+    return NULL;
+}
+
+
+static PyObject *
+BTree_setmutex(BTree *self)
+{
+    bool success = 0;
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbsetmutex(self->db);
+    Py_END_ALLOW_THREADS
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    self->mutex = true;
+    Py_RETURN_NONE;
+}
+
+
+static int
+BTree_cmpfunc(const char *abuf, int asiz, const char *bbuf, int bsiz, BTree *self)
+{
+    int retval = 0;
+    PyObject *args, *result;
+    PyGILState_STATE gilstate;
+    
+    gilstate = PyGILState_Ensure();
+    
+    args = Py_BuildValue("(s#s#O)", abuf, asiz, bbuf, bsiz, self->cmpop);
+    if (!args)
+    {
+        /* PyThreadState_SetAsyncExc in main thread ?? */
+        PyGILState_Release(gilstate);
+        return 0;
+    }
+    
+    result = PyEval_CallObject(self->cmp, args);
+    Py_DECREF(args);
+    
+    if (!result)
+    {
+        /* Again...PyThreadState_SetAsyncExc? */
+        PyGILState_Release(gilstate);
+        return 0;
+    }
+    
+    retval = PyLong_AsLong(result);
+    Py_DECREF(result);
+    PyGILState_Release(gilstate);
+    return retval;
+}
+
+
+/*
+ * Native comparators. None of these touch Python, so trees using them run at
+ * the speed of tcbdbcmplexical and never take the GIL.
+ */
+
+static int
+btree_cmprevlexical(const char *abuf, int asiz, const char *bbuf, int bsiz, void *op)
+{
+    return -tcbdbcmplexical(abuf, asiz, bbuf, bsiz, op);
+}
+
+
+static int
+btree_cmpcaselexical(const char *abuf, int asiz, const char *bbuf, int bsiz, void *op)
+{
+    int i, a, b;
+    int min = asiz < bsiz ? asiz : bsiz;
+    
+    for (i = 0; i < min; i++)
+    {
+        a = tolower((unsigned char) abuf[i]);
+        b = tolower((unsigned char) bbuf[i]);
+        if (a != b)
+        {
+            return a - b;
+        }
+    }
+    return asiz - bsiz;
+}
+
+
+static int
+btree_cmplength(const char *abuf, int asiz, const char *bbuf, int bsiz, void *op)
+{
+    if (asiz != bsiz)
+    {
+        return asiz < bsiz ? -1 : 1;
+    }
+    return memcmp(abuf, bbuf, asiz);
+}
+
+
+static uint64_t
+btree_readbe64(const char *buf)
+{
+    int i;
+    uint64_t num = 0;
+    
+    for (i = 0; i < 8; i++)
+    {
+        num = (num << 8) | (unsigned char) buf[i];
+    }
+    return num;
+}
+
+
+static uint64_t
+btree_readle64(const char *buf)
+{
+    int i;
+    uint64_t num = 0;
+    
+    for (i = 7; i >= 0; i--)
+    {
+        num = (num << 8) | (unsigned char) buf[i];
+    }
+    return num;
+}
+
+
+/*
+ * Keys that are not exactly eight bytes long sort before every eight-byte
+ * key, and lexically among themselves. Comparing them lexically against
+ * eight-byte keys too would not be transitive once numeric and byte order
+ * disagree, which corrupts the tree.
+ */
+#define BTREE_CMPU64(abuf, asiz, bbuf, bsiz, a, b) \
+    if (asiz != 8 || bsiz != 8) \
+    { \
+        if (asiz == 8 || bsiz == 8) \
+        { \
+            return asiz == 8 ? 1 : -1; \
+        } \
+        return tcbdbcmplexical(abuf, asiz, bbuf, bsiz, NULL); \
+    } \
+    return (a) < (b) ? -1 : (a) > (b)
+
+
+static int
+btree_cmpint64be(const char *abuf, int asiz, const char *bbuf, int bsiz, void *op)
+{
+    BTREE_CMPU64(abuf, asiz, bbuf, bsiz,
+        (int64_t) btree_readbe64(abuf), (int64_t) btree_readbe64(bbuf));
+}
+
+
+static int
+btree_cmpint64le(const char *abuf, int asiz, const char *bbuf, int bsiz, void *op)
+{
+    BTREE_CMPU64(abuf, asiz, bbuf, bsiz,
+        (int64_t) btree_readle64(abuf), (int64_t) btree_readle64(bbuf));
+}
+
+
+/*
+ * Map the bits of an IEEE 754 double onto an unsigned integer with the same
+ * order, so doubles (including -0.0, infinities and NaNs) sort totally.
+ */
+static uint64_t
+btree_doublebits(uint64_t bits)
+{
+    return (bits & 0x8000000000000000ULL) ? ~bits : bits | 0x8000000000000000ULL;
+}
+
+
+static int
+btree_cmpdoublebe(const char *abuf, int asiz, const char *bbuf, int bsiz, void *op)
+{
+    BTREE_CMPU64(abuf, asiz, bbuf, bsiz,
+        btree_doublebits(btree_readbe64(abuf)), btree_doublebits(btree_readbe64(bbuf)));
+}
+
+
+static int
+btree_cmpdoublele(const char *abuf, int asiz, const char *bbuf, int bsiz, void *op)
+{
+    BTREE_CMPU64(abuf, asiz, bbuf, bsiz,
+        btree_doublebits(btree_readle64(abuf)), btree_doublebits(btree_readle64(bbuf)));
+}
+
+
+typedef struct
+{
+    const char *name;
+    TCCMP cmp;
+} BTreeBuiltinCmp;
+
+
+/* Indexed by the CMP* module constants. */
+static BTreeBuiltinCmp BTree_builtin_cmp[] =
+{
+    { NULL, NULL },
+    { "lexical", (TCCMP) tcbdbcmplexical },
+    { "decimal", (TCCMP) tcbdbcmpdecimal },
+    { "int32", (TCCMP) tcbdbcmpint32 },
+    { "int64", (TCCMP) tcbdbcmpint64 },
+    { "revlexical", btree_cmprevlexical },
+    { "caselexical", btree_cmpcaselexical },
+    { "length", btree_cmplength },
+    { "int64be", btree_cmpint64be },
+    { "int64le", btree_cmpint64le },
+    { "doublebe", btree_cmpdoublebe },
+    { "doublele", btree_cmpdoublele }
+};
+
+#define BTREE_NBUILTIN ((int) (sizeof(BTree_builtin_cmp) / sizeof(BTree_builtin_cmp[0])))
+
+
+static const char *
+btree_nextfield(const char **pos, const char *end, int delim, int *fsiz)
+{
+    const char *field = *pos;
+    const char *sep;
+    uint32_t len;
+    
+    if (delim >= 0)
+    {
+        if (field > end)
+        {
+            return NULL;
+        }
+        sep = memchr(field, delim, end - field);
+        if (!sep)
+        {
+            sep = end;
+        }
+        *fsiz = sep - field;
+        *pos = sep + 1;
+        return field;
+    }
+    
+    if (field >= end)
+    {
+        return NULL;
+    }
+    if (end - field < 4)
+    {
+        *fsiz = end - field;
+        *pos = end;
+        return field;
+    }
+    len = ((uint32_t) (unsigned char) field[0] << 24) |
+        ((uint32_t) (unsigned char) field[1] << 16) |
+        ((uint32_t) (unsigned char) field[2] << 8) |
+        (uint32_t) (unsigned char) field[3];
+    field += 4;
+    if (len > (uint32_t) (end - field))
+    {
+        len = end - field;
+    }
+    *fsiz = len;
+    *pos = field + len;
+    return field;
+}
+
+
+static int
+btree_cmpcomposite(const char *abuf, int asiz, const char *bbuf, int bsiz, BTreeCmpSpec *spec)
+{
+    int i, rv, afsiz, bfsiz;
+    const char *afield, *bfield;
+    const char *apos = abuf, *aend = abuf + asiz;
+    const char *bpos = bbuf, *bend = bbuf + bsiz;
+    
+    for (i = 0; i < spec->fnum; i++)
+    {
+        afield = btree_nextfield(&apos, aend, spec->delim, &afsiz);
+        bfield = btree_nextfield(&bpos, bend, spec->delim, &bfsiz);
+        
+        if (!afield || !bfield)
+        {
+            return afield ? 1 : bfield ? -1 : 0;
+        }
+        
+        rv = spec->fields[i].cmp(afield, afsiz, bfield, bfsiz, NULL);
+        if (rv)
+        {
+            return spec->fields[i].desc ? -rv : rv;
+        }
+    }
+    
+    if (apos > aend)
+    {
+        apos = aend;
+    }
+    if (bpos > bend)
+    {
+        bpos = bend;
+    }
+    return tcbdbcmplexical(apos, aend - apos, bpos, bend - bpos, NULL);
+}
+
+
+/* Resolve a CMP* constant or comparator name to an index into BTree_builtin_cmp. */
+static int
+btree_cmplookup(PyObject *obj)
+{
+    int i;
+    long num;
+    const char *name;
+    
+    if (PyInt_Check(obj) || PyLong_Check(obj))
+    {
+        num = PyInt_AsLong(obj);
+        if (num > 0 && num < BTREE_NBUILTIN)
+        {
+            return (int) num;
+        }
+    }
+    else if (PyString_Check(obj))
+    {
+        name = PyString_AS_STRING(obj);
+        for (i = 1; i < BTREE_NBUILTIN; i++)
+        {
+            if (!strcmp(name, BTree_builtin_cmp[i].name))
+            {
+                return i;
+            }
+        }
+    }
+    
+    if (!PyErr_Occurred())
+    {
+        PyErr_SetString(BTreeError, "Unknown comparison function.");
+    }
+    return -1;
+}
+
+
+/*
+ * Build a composite spec from a sequence of field types, each either a CMP*
+ * constant, a comparator name or a (type, descending) pair. The normalized
+ * ((type, descending), ...) tuple is returned through *normalized so the
+ * handle can be pickled.
+ */
+static BTreeCmpSpec *
+btree_cmpspecnew(PyObject *fields, PyObject *delim, PyObject **normalized)
+{
+    int i, n, type, desc;
+    PyObject *seq, *item, *typeobj, *entry;
+    BTreeCmpSpec *spec;
+    
+    seq = PySequence_Fast(fields, "Expected fields to be a sequence.");
+    if (!seq)
+    {
+        return NULL;
+    }
+    
+    n = PySequence_Fast_GET_SIZE(seq);
+    if (n < 1)
+    {
+        Py_DECREF(seq);
+        PyErr_SetString(PyExc_ValueError, "Expected at least one field.");
+        return NULL;
+    }
+    
+    spec = (BTreeCmpSpec *) malloc(sizeof(BTreeCmpSpec) + sizeof(BTreeCmpField) * (n - 1));
+    *normalized = PyTuple_New(n);
+    if (!spec || !*normalized)
+    {
+        free(spec);
+        Py_XDECREF(*normalized);
+        Py_DECREF(seq);
+        return (BTreeCmpSpec *) PyErr_NoMemory();
+    }
+    
+    spec->fnum = n;
+    spec->delim = -1;
+    if (delim && delim != Py_None)
+    {
+        if (!PyString_Check(delim) || PyString_GET_SIZE(delim) != 1)
+        {
+            PyErr_SetString(PyExc_ValueError, "Expected delim to be a single character.");
+            goto error;
+        }
+        spec->delim = (unsigned char) PyString_AS_STRING(delim)[0];
+    }
+    
+    for (i = 0; i < n; i++)
+    {
+        item = PySequence_Fast_GET_ITEM(seq, i);
+        desc = 0;
+        typeobj = item;
+        
+        if (PyTuple_Check(item) &&
+            !PyArg_ParseTuple(item, "Oi:fields", &typeobj, &desc))
+        {
+            goto error;
+        }
+        
+        type = btree_cmplookup(typeobj);
+        if (type < 0)
+        {
+            goto error;
+        }
+        
+        spec->fields[i].cmp = BTree_builtin_cmp[type].cmp;
+        spec->fields[i].desc = desc != 0;
+        
+        entry = Py_BuildValue("(iO)", type, desc ? Py_True : Py_False);
+        if (!entry)
+        {
+            goto error;
+        }
+        PyTuple_SET_ITEM(*normalized, i, entry);
+    }
+    
+    Py_DECREF(seq);
+    return spec;
+    
+error:
+    free(spec);
+    Py_CLEAR(*normalized);
+    Py_DECREF(seq);
+    return NULL;
+}
+
+
+/*
+ * Install a builtin or composite comparator. Either way the previous Python
+ * comparator, if any, is released.
+ */
+static bool
+BTree_setnativecmp(BTree *self, int builtin, PyObject *fields, PyObject *delim)
+{
+    bool success;
+    TCCMP cmp;
+    BTreeCmpSpec *spec = NULL;
+    PyObject *normalized = NULL;
+    
+    if (fields && fields != Py_None)
+    {
+        spec = btree_cmpspecnew(fields, delim, &normalized);
+        if (!spec)
+        {
+            return false;
+        }
+        cmp = (TCCMP) btree_cmpcomposite;
+        builtin = 0;
+    }
+    else
+    {
+        cmp = BTree_builtin_cmp[builtin].cmp;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbsetcmpfunc(self->db, cmp, spec);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        free(spec);
+        Py_XDECREF(normalized);
+        return false;
+    }
+    
+    free(self->cmpspec);
+    self->cmpspec = spec;
+    Py_XDECREF(self->cmpfields);
+    self->cmpfields = normalized;
+    Py_CLEAR(self->cmp);
+    Py_CLEAR(self->cmpop);
+    self->builtin = builtin;
+    return true;
+}
+
+
+static PyObject *
+BTree_setcmpfunc(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    int success = 0;
+    int builtin;
+    PyObject *cmp = NULL, *cmpop = NULL, *builtinobj = NULL;
+    PyObject *fields = NULL, *delim = NULL;
+    static char *kwlist[] = { "cmp", "cmpop", "builtin", "fields", "delim", NULL };
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOOO:setcmpfunc", 
+        kwlist, &cmp, &cmpop, &builtinobj, &fields, &delim))
+    {
+        return NULL;
+    }
+    
+    if (fields && fields != Py_None)
+    {
+        if (!BTree_setnativecmp(self, 0, fields, delim))
+        {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+    
+    if (builtinobj && builtinobj != Py_None &&
+        !((PyInt_Check(builtinobj) || PyLong_Check(builtinobj)) && PyInt_AsLong(builtinobj) <= 0))
+    {
+        builtin = btree_cmplookup(builtinobj);
+        if (builtin < 0 || !BTree_setnativecmp(self, builtin, NULL, NULL))
+        {
+            return NULL;
+        }
+        Py_RETURN_NONE;
+    }
+    
+    if (!cmp || !PyCallable_Check(cmp))
+    {
+        PyErr_SetString(PyExc_TypeError, "Expected cmp to be callable.");
+        return NULL;
+    }
+    
+    if (!cmpop)
+    {
+        cmpop = Py_None;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbsetcmpfunc(self->db, (TCCMP) BTree_cmpfunc, self);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    Py_INCREF(cmp);
+    Py_INCREF(cmpop);
+    Py_XDECREF(self->cmp);
+    Py_XDECREF(self->cmpop);
+    self->cmp = cmp;
+    self->cmpop = cmpop;
+    
+    free(self->cmpspec);
+    self->cmpspec = NULL;
+    Py_CLEAR(self->cmpfields);
+    self->builtin = -1;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_tune(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    bool success = 0;
+    int lmemb, nmemb;
+    lmemb = nmemb = 0;
+    PY_LONG_LONG bnum = 0;
+    short apow, bpow;
+    apow = bpow = -1;
+    unsigned char opts = 0;
+    
+    static char *kwlist[] = {"lmemb", "nmemb", "bnum", "apow", "bpow", "opts", NULL };
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iiLhhB:tune", kwlist, 
+        &lmemb, &nmemb, &bnum, &apow, &bpow, &opts))
+    {
+        return NULL;
+    }
+    
+    if (apow < SCHAR_MIN || apow > SCHAR_MAX ||
+        bpow < SCHAR_MIN || bpow > SCHAR_MAX)
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbtune(self->db, lmemb, nmemb, bnum, apow, bpow, opts);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_setcache(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    bool success = 0;
+    int lcnum, ncnum;
+    lcnum = ncnum = 0;
+    
+    static char *kwlist[] = {"lcnum", "ncnum", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ii", kwlist, &lcnum, &ncnum))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbsetcache(self->db, lcnum, ncnum);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    self->lcnum = lcnum;
+    self->ncnum = ncnum;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_setxmsize(BTree *self, PyObject *args)
+{
+    bool success = 0;
+    PY_LONG_LONG xmsiz = 0;
+    
+    if (!PyArg_ParseTuple(args, "L", &xmsiz))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbsetxmsiz(self->db, xmsiz);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    self->xmsiz = xmsiz;
+    Py_RETURN_NONE;
+}
+
+
+static int
+btree_cachestatson(BTree *self)
+{
+    if (self->mutex)
+    {
+        PyErr_SetString(PyExc_ValueError,
+            "Cache statistics are not available on handles shared between threads (setmutex).");
+        return -1;
+    }
+    
+    if (!self->lmirror)
+    {
+        self->lmirror = tcmapnew();
+        self->nmirror = tcmapnew();
+        if (!self->lmirror || !self->nmirror)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Cannot allocate cache mirrors");
+            return -1;
+        }
+    }
+    
+    if (!self->cachestats)
+    {
+        self->cachestats = true;
+        self->csynced = false;
+    }
+    return 0;
+}
+
+
+static PyObject *
+BTree_setcachestats(BTree *self, PyObject *args)
+{
+    PyObject *enable = Py_True;
+    int rv;
+    
+    if (!PyArg_ParseTuple(args, "|O:setcachestats", &enable))
+    {
+        return NULL;
+    }
+    
+    if ((rv = PyObject_IsTrue(enable)) < 0)
+    {
+        return NULL;
+    }
+    
+    if (rv)
+    {
+        if (btree_cachestatson(self))
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        /* The budget is adapted from the counters, so it stops too. */
+        self->cachestats = false;
+        self->cbudget = 0;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_setcachebudget(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PY_LONG_LONG budget;
+    int interval = 1000;
+    
+    static char *kwlist[] = {"budget", "interval", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "L|i:setcachebudget", kwlist,
+        &budget, &interval))
+    {
+        return NULL;
+    }
+    
+    if (budget < 0 || interval < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected a non-negative budget and a positive interval.");
+        return NULL;
+    }
+    
+    if (budget > 0 && btree_cachestatson(self))
+    {
+        return NULL;
+    }
+    
+    self->cbudget = budget;
+    self->cinterval = interval;
+    if (self->cnodeshare <= 0.0)
+    {
+        self->cnodeshare = 0.2;
+    }
+    memset(&self->cwindow, 0, sizeof(self->cwindow));
+    
+    if (budget > 0 && self->csynced)
+    {
+        btree_cacheadapt(self);
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_cachestats(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *reset = Py_False, *stats;
+    BTreeCacheCount *c = &self->ctotal;
+    int rv;
+    
+    static char *kwlist[] = {"reset", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:cachestats", kwlist, &reset))
+    {
+        return NULL;
+    }
+    
+    if ((rv = PyObject_IsTrue(reset)) < 0)
+    {
+        return NULL;
+    }
+    
+    stats = Py_BuildValue("{s:L,s:L,s:L,s:K,s:I,s:L,s:L,s:L,s:K,s:I,s:L}",
+        "leaf_lookups", c->leaflookups,
+        "leaf_loads", c->leafloads,
+        "leaf_evictions", c->leafouts,
+        "leaf_cached", (unsigned PY_LONG_LONG) (self->db->leafc ? tcmaprnum(self->db->leafc) : 0),
+        "leaf_capacity", (unsigned int) self->db->lcnum,
+        "node_lookups", c->nodelookups,
+        "node_loads", c->nodeloads,
+        "node_evictions", c->nodeouts,
+        "node_cached", (unsigned PY_LONG_LONG) (self->db->nodec ? tcmaprnum(self->db->nodec) : 0),
+        "node_capacity", (unsigned int) self->db->ncnum,
+        "budget", self->cbudget);
+    
+    if (stats && rv)
+    {
+        memset(c, 0, sizeof(*c));
+    }
+    return stats;
+}
+
+
+static PyObject *
+BTree_open(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    int omode = BDBOWRITER | BDBOCREAT;
+    char *path = NULL;
+    static char *kwlist[] = { "path", "omode", NULL };
+    
+    if (PyArg_ParseTupleAndKeywords(args, kwargs, "s|i:open", kwlist, &path, &omode))
+    {
+        bool success = 0;
+        Py_BEGIN_ALLOW_THREADS
+        success = tcbdbopen(self->db, path, omode);
+        Py_END_ALLOW_THREADS
+        if (success)
+        {
+            BTree_setopened(self, path, omode);
+            Py_RETURN_NONE;
+        }
+        raise_btree_error(self->db);
+    }
+    return NULL;
+}
+
+
+static PyObject *
+BTree_close(BTree *self)
+{
+    bool success = 0;
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbclose(self->db);
+    Py_END_ALLOW_THREADS
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    BTree_setopened(self, NULL, 0);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_put(BTree *self, PyObject *args)
+{
+    bool probe;
+    bool success;
+    char *kbuf, *vbuf;
+    int ksiz, vsiz;
+    
+    if (!PyArg_ParseTuple(args, "s#s#:put", &kbuf, &ksiz, &vbuf, &vsiz))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbput(self->db, kbuf, ksiz, vbuf, vsiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_putkeep(BTree *self, PyObject *args)
+{
+    bool probe;
+    bool success;
+    char *kbuf, *vbuf;
+    int ksiz, vsiz;
+    
+    if (!PyArg_ParseTuple(args, "s#s#:putkeep", &kbuf, &ksiz, &vbuf, &vsiz))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbputkeep(self->db, kbuf, ksiz, vbuf, vsiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_putcat(BTree *self, PyObject *args)
+{
+    bool probe;
+    bool success;
+    char *kbuf, *vbuf;
+    int ksiz, vsiz;
+    
+    if (!PyArg_ParseTuple(args, "s#s#:putcat", &kbuf, &ksiz, &vbuf, &vsiz))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbputcat(self->db, kbuf, ksiz, vbuf, vsiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_putdup(BTree *self, PyObject *args)
+{
+    bool probe;
+    bool success;
+    char *kbuf, *vbuf;
+    int ksiz, vsiz;
+    
+    if (!PyArg_ParseTuple(args, "s#s#:putdup", &kbuf, &ksiz, &vbuf, &vsiz))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbputdup(self->db, kbuf, ksiz, vbuf, vsiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static TCLIST *
+pyseq2tclist(PyObject *seq)
+{
+    PyObject *fast, *value;
+    Py_ssize_t i, n;
+    TCLIST *list;
+    
+    fast = PySequence_Fast(seq, "Expected values to be an iterable of strings.");
+    if (!fast)
+    {
+        return NULL;
+    }
+    
+    n = PySequence_Fast_GET_SIZE(fast);
+    list = tclistnew2(n > 0 ? (int) n : 1);
+    if (!list)
+    {
+        Py_DECREF(fast);
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memory for TCLIST object");
+        return NULL;
+    }
+    
+    for (i=0; i<n; i++)
+    {
+        value = PySequence_Fast_GET_ITEM(fast, i);
+        if (!PyString_Check(value))
+        {
+            tclistdel(list);
+            Py_DECREF(fast);
+            PyErr_SetString(PyExc_TypeError, "All values must be strings.");
+            return NULL;
+        }
+        tclistpush(list, PyString_AS_STRING(value), (int) PyString_GET_SIZE(value));
+    }
+    
+    Py_DECREF(fast);
+    return list;
+}
+
+
+static PyObject *
+BTree_putdups(BTree *self, PyObject *args)
+{
+    bool probe;
+    bool success;
+    char *kbuf;
+    int ksiz;
+    PyObject *values;
+    TCLIST *list;
+    
+    if (!PyArg_ParseTuple(args, "s#O:putdups", &kbuf, &ksiz, &values))
+    {
+        return NULL;
+    }
+    
+    list = pyseq2tclist(values);
+    if (!list)
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbputdup3(self->db, kbuf, ksiz, list);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    tclistdel(list);
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Convert every (key, values) pair first, then store them all in one
+ * stretch without the GIL. Keys keep the order they were given in.
+ */
+static PyObject *
+BTree_putdupmany(BTree *self, PyObject *args)
+{
+    bool success = true;
+    const char *kbuf;
+    int i, n, ksiz;
+    PyObject *pairs, *fast, *item;
+    TCLIST *keys, **lists;
+    
+    if (!PyArg_ParseTuple(args, "O:putdupmany", &pairs))
+    {
+        return NULL;
+    }
+    
+    fast = PySequence_Fast(pairs, "Expected an iterable of (key, values) pairs.");
+    if (!fast)
+    {
+        return NULL;
+    }
+    
+    n = (int) PySequence_Fast_GET_SIZE(fast);
+    keys = tclistnew2(n > 0 ? n : 1);
+    lists = (TCLIST **) calloc(n > 0 ? n : 1, sizeof(TCLIST *));
+    if (!keys || !lists)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memory for TCLIST object");
+        success = false;
+        n = 0;
+    }
+    
+    for (i=0; i<n; i++)
+    {
+        PyObject *values;
+        char *kptr;
+        
+        item = PySequence_Fast_GET_ITEM(fast, i);
+        if (!PyTuple_Check(item) ||
+            !PyArg_ParseTuple(item, "s#O", &kptr, &ksiz, &values))
+        {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_TypeError, "Expected (key, values) tuples.");
+            success = false;
+            break;
+        }
+        
+        lists[i] = pyseq2tclist(values);
+        if (!lists[i])
+        {
+            success = false;
+            break;
+        }
+        tclistpush(keys, kptr, ksiz);
+    }
+    
+    if (success && n > 0)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        for (i=0; i<n; i++)
+        {
+            kbuf = tclistval(keys, i, &ksiz);
+            if (!tcbdbputdup3(self->db, kbuf, ksiz, lists[i]))
+            {
+                success = false;
+                break;
+            }
+        }
+        Py_END_ALLOW_THREADS
+        
+        if (!success)
+        {
+            raise_btree_error(self->db);
+        }
+    }
+    
+    if (lists)
+    {
+        for (i=0; i<n; i++)
+        {
+            if (lists[i])
+            {
+                tclistdel(lists[i]);
+            }
+        }
+        free(lists);
+    }
+    if (keys)
+    {
+        tclistdel(keys);
+    }
+    Py_DECREF(fast);
+    
+    if (!success)
+    {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+#define BTREE_BULKCHUNK 4096
+#define BTREE_LMEMBDEF 128
+#define BTREE_NMEMBDEF 256
+
+
+/*
+ * Tune a handle that is about to be bulk loaded into a new file. Tokyo
+ * Cabinet always divides a full leaf or node in the middle, so ascending
+ * input leaves every page half full; doubling the page sizes, scaled by
+ * fill, makes the finished tree hold fill times the default page size.
+ */
+static bool
+btree_bulktune(TCBDB *db, double fill, PY_LONG_LONG rnum, unsigned char opts)
+{
+    int lmemb, nmemb;
+    int64_t bnum = 0;
+    
+    lmemb = (int) (BTREE_LMEMBDEF * 2 * fill);
+    nmemb = (int) (BTREE_NMEMBDEF * 2 * fill);
+    if (lmemb < 4)
+    {
+        lmemb = 4;
+    }
+    if (nmemb < 8)
+    {
+        nmemb = 8;
+    }
+    
+    /* The bucket array should be about twice the number of leaves. */
+    if (rnum > 0)
+    {
+        bnum = (int64_t) (rnum / (lmemb / 2) + 1) * 2;
+    }
+    
+    return tcbdbtune(db, lmemb, nmemb, bnum, -1, -1, opts);
+}
+
+
+/*
+ * Given a path, the file is created (or truncated, if asked to) and tuned
+ * for the input, replacing any earlier tune() settings. fill, rnum and opts
+ * only make sense there; an open database keeps its own tuning.
+ */
+static PyObject *
+BTree_bulkload(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *iterable, *iter, *item, *fillobj = NULL;
+    struct stat sbuf;
+    double fill = 0.95;
+    char *path = NULL;
+    char *kbuf, *vbuf;
+    const char *lbuf;
+    int i, n, ksiz, vsiz;
+    unsigned char opts = 0;
+    PY_LONG_LONG rnum = 0, count = 0;
+    bool success = true, havelast = false;
+    int dup = 0, truncate = 0;
+    TCCMP cmp;
+    void *cmpop;
+    TCLIST *keys, *vals;
+    TCXSTR *last;
+    BDBCUR *cur;
+    
+    static char *kwlist[] = {"iterable", "fill", "path", "rnum", "opts", "dup",
+        "truncate", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OzLBii:bulkload", kwlist,
+        &iterable, &fillobj, &path, &rnum, &opts, &dup, &truncate))
+    {
+        return NULL;
+    }
+    
+    if (!path && (fillobj || rnum || opts || truncate))
+    {
+        PyErr_SetString(PyExc_ValueError,
+            "fill, rnum, opts and truncate only apply when bulk loading into a new file (path).");
+        return NULL;
+    }
+    
+    if (fillobj && (fill = PyFloat_AsDouble(fillobj)) == -1.0 && PyErr_Occurred())
+    {
+        return NULL;
+    }
+    
+    if (fill <= 0.0 || fill > 1.0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected fill to be in (0, 1].");
+        return NULL;
+    }
+    
+    if (path)
+    {
+        if (self->path)
+        {
+            PyErr_SetString(BTreeError, "Close the database before bulk loading into a new file.");
+            return NULL;
+        }
+        
+        if (!truncate && !stat(path, &sbuf))
+        {
+            PyErr_Format(BTreeError,
+                "%s already exists; pass truncate=True to replace its contents.", path);
+            return NULL;
+        }
+        
+        Py_BEGIN_ALLOW_THREADS
+        success = btree_bulktune(self->db, fill, rnum, opts) &&
+            tcbdbopen(self->db, path, BDBOWRITER | BDBOCREAT | BDBOTRUNC);
+        Py_END_ALLOW_THREADS
+        
+        if (!success)
+        {
+            raise_btree_error(self->db);
+            return NULL;
+        }
+        BTree_setopened(self, path, BDBOWRITER | BDBOCREAT);
+    }
+    
+    iter = PyObject_GetIter(iterable);
+    if (!iter)
+    {
+        return NULL;
+    }
+    
+    keys = tclistnew();
+    vals = tclistnew();
+    last = tcxstrnew();
+    cur = tcbdbcurnew(self->db);
+    cmp = tcbdbcmpfunc(self->db);
+    cmpop = tcbdbcmpop(self->db);
+    
+    if (!keys || !vals || !last || !cur)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate bulk load buffers");
+        success = false;
+    }
+    else
+    {
+        /* New records have to sort after everything already stored. */
+        Py_BEGIN_ALLOW_THREADS
+        if (tcbdbcurlast(cur) && (lbuf = tcbdbcurkey3(cur, &ksiz)) != NULL)
+        {
+            tcxstrcat(last, lbuf, ksiz);
+            havelast = true;
+        }
+        Py_END_ALLOW_THREADS
+    }
+    
+    while (success)
+    {
+        tclistclear(keys);
+        tclistclear(vals);
+        
+        for (n=0; n<BTREE_BULKCHUNK && (item = PyIter_Next(iter)); n++)
+        {
+            if (!PyTuple_Check(item) ||
+                !PyArg_ParseTuple(item, "s#s#", &kbuf, &ksiz, &vbuf, &vsiz))
+            {
+                if (!PyErr_Occurred() || PyErr_ExceptionMatches(PyExc_TypeError))
+                {
+                    PyErr_Clear();
+                    PyErr_SetString(PyExc_TypeError, "Expected (key, value) tuples of strings.");
+                }
+                Py_DECREF(item);
+                break;
+            }
+            
+            if (havelast && cmp(kbuf, ksiz, tcxstrptr(last), tcxstrsize(last), cmpop) < 0)
+            {
+                PyErr_Format(PyExc_ValueError,
+                    "Keys are not in ascending order at record %lld.", count + n);
+                Py_DECREF(item);
+                break;
+            }
+            
+            tcxstrclear(last);
+            tcxstrcat(last, kbuf, ksiz);
+            havelast = true;
+            
+            tclistpush(keys, kbuf, ksiz);
+            tclistpush(vals, vbuf, vsiz);
+            Py_DECREF(item);
+        }
+        
+        /* Records read before a bad one are still stored. */
+        Py_BEGIN_ALLOW_THREADS
+        for (i=0; i<n; i++)
+        {
+            const char *kptr, *vptr;
+            
+            kptr = tclistval(keys, i, &ksiz);
+            vptr = tclistval(vals, i, &vsiz);
+            /* A repeated key overwrites, as with put, unless dup asks to keep both. */
+            if (!(dup ? tcbdbputdup(self->db, kptr, ksiz, vptr, vsiz) :
+                tcbdbput(self->db, kptr, ksiz, vptr, vsiz)))
+            {
+                success = false;
+                break;
+            }
+        }
+        Py_END_ALLOW_THREADS
+        
+        count += i;
+        
+        if (!success)
+        {
+            raise_btree_error(self->db);
+        }
+        else if (PyErr_Occurred())
+        {
+            success = false;
+        }
+        else if (n < BTREE_BULKCHUNK)
+        {
+            break;
+        }
+    }
+    
+    if (cur)
+    {
+        tcbdbcurdel(cur);
+    }
+    if (last)
+    {
+        tcxstrdel(last);
+    }
+    if (keys)
+    {
+        tclistdel(keys);
+    }
+    if (vals)
+    {
+        tclistdel(vals);
+    }
+    Py_DECREF(iter);
+    
+    if (!success)
+    {
+        return NULL;
+    }
+    return PyLong_FromLongLong(count);
+}
+
+
+static PyObject *
+BTree_out(BTree *self, PyObject *args)
+{
+    bool probe;
+    bool success;
+    char *kbuf;
+    int ksiz;
+    
+    if (!PyArg_ParseTuple(args, "s#:out", &kbuf, &ksiz))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbout(self->db, kbuf, ksiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_outdup(BTree *self, PyObject *args)
+{
+    bool success;
+    char *kbuf;
+    int ksiz;
+    
+    if (!PyArg_ParseTuple(args, "s#:outdup", &kbuf, &ksiz))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbout3(self->db, kbuf, ksiz);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+/*
+ * Remove the records in a range with one cursor, chunk records per
+ * transaction. After each commit the cursor is jumped back to the start of
+ * the range, whose first remaining record is the next one to go. Inside a
+ * transaction opened with tranbegin the removals simply join it, since
+ * tcbdbtranbegin would wait for that transaction to end.
+ */
+static PyObject *
+BTree_out_range(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *start = Py_None, *stop = Py_None, *transaction = Py_True;
+    int binc = 1, einc = 0, chunk = 1000, tran;
+    PY_LONG_LONG max = -1, count = 0, n;
+    bool ok, success = true, probe;
+    BTreeWalk walk;
+    
+    static char *kwlist[] = {"start", "stop", "inclusive", "max", "transaction",
+        "chunk", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO(ii)LOi:out_range", kwlist,
+        &start, &stop, &binc, &einc, &max, &transaction, &chunk))
+    {
+        return NULL;
+    }
+    
+    if (chunk < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected chunk to be at least 1.");
+        return NULL;
+    }
+    
+    if ((tran = PyObject_IsTrue(transaction)) < 0 ||
+        btree_walkinit(&walk, self, start, stop, binc, einc, false))
+    {
+        return NULL;
+    }
+    
+    if (self->tran)
+    {
+        tran = 0;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    while (max < 0 || count < max)
+    {
+        if (tran && !tcbdbtranbegin(self->db))
+        {
+            success = false;
+            break;
+        }
+        
+        walk.started = walk.done = false;
+        ok = btree_walknext(&walk, false);
+        for (n=0; ok && n<chunk && (max < 0 || count + n < max); n++)
+        {
+            if (!tcbdbcurout(walk.cur))
+            {
+                success = false;
+                break;
+            }
+            ok = btree_walkread(&walk, false) && btree_walkinrange(&walk);
+        }
+        
+        if (!success)
+        {
+            if (tran)
+            {
+                tcbdbtranabort(self->db);
+            }
+            break;
+        }
+        
+        if (tran && !tcbdbtrancommit(self->db))
+        {
+            success = false;
+            break;
+        }
+        
+        count += n;
+        if (!ok)
+        {
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    btree_probewalk(self, probe, &walk);
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        btree_walkfree(&walk);
+        return NULL;
+    }
+    
+    btree_walkfree(&walk);
+    return PyLong_FromLongLong(count);
+}
+
+
+static PyObject *
+BTree_get(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    bool probe;
+    char *kbuf, *vbuf;
+    int ksiz, vsiz;
+    PyObject *default_value = NULL;
+    PyObject *value = NULL;
+    
+    static char *kwlist[] = {"key", "default", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|O:outdup", kwlist, &kbuf, &ksiz, &default_value))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    vbuf = tcbdbget(self->db, kbuf, ksiz, &vsiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    if (!vbuf)
+    {
+        if (default_value)
+        {
+            return default_value;
+        }
+        Py_RETURN_NONE;
+    }
+    
+    value = PyString_FromStringAndSize(vbuf, vsiz);
+    free(vbuf);
+    
+    if (!value)
+    {
+        return NULL;
+    }
+    
+    return value;
+}
+
+
+typedef struct
+{
+    const char **kbufs;
+    int *ksizs;
+    TCCMP cmp;
+    void *cmpop;
+} BTreeKeySort;
+
+
+/* Stable merge sort of key indexes; qsort has no way to pass the comparator's opaque. */
+static void
+btree_sortkeys(BTreeKeySort *ks, int *idx, int *tmp, int n)
+{
+    int i, j, k, mid;
+    
+    if (n < 2)
+    {
+        return;
+    }
+    
+    mid = n / 2;
+    btree_sortkeys(ks, idx, tmp, mid);
+    btree_sortkeys(ks, idx + mid, tmp, n - mid);
+    
+    for (i=0, j=mid, k=0; i<mid && j<n; k++)
+    {
+        if (ks->cmp(ks->kbufs[idx[j]], ks->ksizs[idx[j]],
+            ks->kbufs[idx[i]], ks->ksizs[idx[i]], ks->cmpop) < 0)
+        {
+            tmp[k] = idx[j++];
+        }
+        else
+        {
+            tmp[k] = idx[i++];
+        }
+    }
+    while (i < mid)
+    {
+        tmp[k++] = idx[i++];
+    }
+    while (j < n)
+    {
+        tmp[k++] = idx[j++];
+    }
+    memcpy(idx, tmp, n * sizeof(int));
+}
+
+
+/*
+ * Look the keys up in comparator order with one cursor. A key close after
+ * the previous one is reached by stepping forward within the leaf; only a
+ * key further away costs a new descent from the root. The keys are copied
+ * first: the caller's list may change while the GIL is released.
+ */
+static PyObject *
+BTree_getmany(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    bool probe;
+    PyObject *keys, *fast, *key, *pylist, *value;
+    PyObject *default_value = Py_None;
+    BTreeKeySort ks;
+    BDBCUR *cur = NULL;
+    TCLIST *klist = NULL, *vals = NULL;
+    int *idx = NULL, *tmp = NULL;
+    char *found = NULL;
+    const char *ckbuf, *vbuf;
+    int i, n, step, cksiz, vsiz, rv, jumps = 0;
+    bool valid;
+    
+    static char *kwlist[] = {"keys", "default", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|O:getmany", kwlist,
+        &keys, &default_value))
+    {
+        return NULL;
+    }
+    
+    fast = PySequence_Fast(keys, "Expected an iterable of keys.");
+    if (!fast)
+    {
+        return NULL;
+    }
+    
+    n = (int) PySequence_Fast_GET_SIZE(fast);
+    ks.kbufs = (const char **) malloc((n + 1) * sizeof(char *));
+    ks.ksizs = (int *) malloc((n + 1) * sizeof(int));
+    ks.cmp = tcbdbcmpfunc(self->db);
+    ks.cmpop = tcbdbcmpop(self->db);
+    idx = (int *) malloc((n + 1) * sizeof(int));
+    tmp = (int *) malloc((n + 1) * sizeof(int));
+    found = (char *) calloc(n + 1, 1);
+    klist = tclistnew2(n + 1);
+    vals = tclistnew2(n + 1);
+    cur = tcbdbcurnew(self->db);
+    pylist = NULL;
+    
+    if (!ks.kbufs || !ks.ksizs || !idx || !tmp || !found || !klist || !vals || !cur)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate lookup buffers");
+        goto done;
+    }
+    
+    for (i=0; i<n; i++)
+    {
+        key = PySequence_Fast_GET_ITEM(fast, i);
+        if (!PyString_Check(key))
+        {
+            PyErr_SetString(PyExc_TypeError, "All keys must be strings.");
+            goto done;
+        }
+        tclistpush(klist, PyString_AS_STRING(key), (int) PyString_GET_SIZE(key));
+    }
+    
+    for (i=0; i<n; i++)
+    {
+        ks.kbufs[i] = tclistval(klist, i, &ks.ksizs[i]);
+        idx[i] = i;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    btree_sortkeys(&ks, idx, tmp, n);
+    
+    valid = false;
+    for (i=0; i<n; i++)
+    {
+        int k = idx[i];
+        
+        rv = -1;
+        for (step=0; valid && step<BTREE_GETSTEPS; step++)
+        {
+            ckbuf = tcbdbcurkey3(cur, &cksiz);
+            rv = ckbuf ? ks.cmp(ckbuf, cksiz, ks.kbufs[k], ks.ksizs[k], ks.cmpop) : 1;
+            if (rv >= 0)
+            {
+                break;
+            }
+            valid = tcbdbcurnext(cur);
+        }
+        
+        if (!valid || rv < 0)
+        {
+            valid = tcbdbcurjump(cur, ks.kbufs[k], ks.ksizs[k]);
+            jumps++;
+            ckbuf = valid ? tcbdbcurkey3(cur, &cksiz) : NULL;
+            rv = ckbuf ? ks.cmp(ckbuf, cksiz, ks.kbufs[k], ks.ksizs[k], ks.cmpop) : 1;
+        }
+        
+        if (rv == 0 && (vbuf = tcbdbcurval3(cur, &vsiz)) != NULL)
+        {
+            tclistpush(vals, vbuf, vsiz);
+            found[k] = 1;
+        }
+        else
+        {
+            tclistpush(vals, "", 0);
+        }
+        
+        /* Past the last record, every remaining key is missing too. */
+        if (!valid && tcbdbecode(self->db) == TCENOREC)
+        {
+            for (i++; i<n; i++)
+            {
+                tclistpush(vals, "", 0);
+            }
+        }
+    }
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, n, jumps);
+    
+    pylist = PyList_New(n);
+    if (!pylist)
+    {
+        goto done;
+    }
+    
+    for (i=0; i<n; i++)
+    {
+        int k = idx[i];
+        
+        if (found[k])
+        {
+            vbuf = tclistval(vals, i, &vsiz);
+            value = PyString_FromStringAndSize(vbuf, vsiz);
+            if (!value)
+            {
+                Py_CLEAR(pylist);
+                goto done;
+            }
+        }
+        else
+        {
+            Py_INCREF(default_value);
+            value = default_value;
+        }
+        PyList_SET_ITEM(pylist, k, value);
+    }
+    
+done:
+    if (cur)
+    {
+        tcbdbcurdel(cur);
+    }
+    if (vals)
+    {
+        tclistdel(vals);
+    }
+    if (klist)
+    {
+        tclistdel(klist);
+    }
+    free(found);
+    free(tmp);
+    free(idx);
+    free(ks.ksizs);
+    free(ks.kbufs);
+    Py_DECREF(fast);
+    return pylist;
+}
+
+
+static PyObject *
+BTree_getdup(BTree *self, PyObject *args)
+{
+    bool probe;
+    char *kbuf;
+    int ksiz, i, n;
+    PyObject *pylist;
+    TCLIST *list;
+    
+    if (!PyArg_ParseTuple(args, "s#:getdup", &kbuf, &ksiz))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    list = tcbdbget4(self->db, kbuf, ksiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    if (!list)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    n = tclistnum(list);
+    pylist = PyList_New(n);
+    if (pylist)
+    {
+        for (i=0; i<n; i++)
+        {
+            int vsiz;
+            const char *vbuf;
+            PyObject *value;
+            
+            vbuf = tclistval(list, i, &vsiz);
+            value = PyString_FromStringAndSize(vbuf, vsiz);
+            PyList_SET_ITEM(pylist, i, value);
+        }
+    }
+    tclistdel(list);
+    
+    return pylist;
+}
+
+
+static PyObject *
+BTree_idup(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *key, *reverse = Py_False;
+    BTreeRangeIter *iter;
+    int batch = 100, rev;
+    PY_LONG_LONG offset = 0, limit = -1;
+    
+    static char *kwlist[] = {"key", "batch", "reverse", "offset", "limit", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "S|iOLL:idup", kwlist,
+        &key, &batch, &reverse, &offset, &limit))
+    {
+        return NULL;
+    }
+    
+    if ((rev = PyObject_IsTrue(reverse)) < 0)
+    {
+        return NULL;
+    }
+    
+    if (offset < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected offset to be non-negative.");
+        return NULL;
+    }
+    
+    iter = (BTreeRangeIter *) btree_rangeiternew(self, key, key, 1, 1, rev != 0,
+        BTREE_ITERVALUES, batch);
+    if (iter)
+    {
+        iter->skip = offset;
+        iter->left = limit < 0 ? -1 : limit;
+    }
+    return (PyObject *) iter;
+}
+
+
+static PyObject *
+BTree_vnum(BTree *self, PyObject *args)
+{
+    bool probe;
+    char *kbuf;
+    int ksiz, vnum;
+    
+    if (!PyArg_ParseTuple(args, "s#:vnum", &kbuf, &ksiz))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    vnum = tcbdbvnum(self->db, kbuf, ksiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    return Py_BuildValue("i", vnum);
+}
+
+
+static PyObject *
+BTree_vsiz(BTree *self, PyObject *args)
+{
+    bool probe;
+    char *kbuf;
+    int ksiz, vsiz;
+    
+    if (!PyArg_ParseTuple(args, "s#:vsiz", &kbuf, &ksiz))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    vsiz = tcbdbvsiz(self->db, kbuf, ksiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    return Py_BuildValue("i", vsiz);
+}
+
+
+static PyObject *
+BTree_range(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    char *bkbuf, *ekbuf;
+    int bksiz, eksiz, binc, einc, i, n;
+    int max = -1;
+    PyObject *pylist;
+    TCLIST *list;
+    
+    static char *kwlist[] = {"bk", "binc", "ek", "einc", "max", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#is#i|i:range", kwlist,
+        &bkbuf, &bksiz, &binc, &ekbuf, &eksiz, &einc, &max))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    list = tcbdbrange(self->db, bkbuf, bksiz, binc, ekbuf, eksiz, einc, max);
+    Py_END_ALLOW_THREADS
+    
+    if (!list)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memort for TCLIST object");
+        return NULL;
+    }
+    
+    n = tclistnum(list);
+    pylist = PyList_New(n);
+    if (pylist)
+    {
+        for (i=0; i<n; i++)
+        {
+            int vsiz;
+            const char *vbuf;
+            PyObject *value;
+            
+            vbuf = tclistval(list, i, &vsiz);
+            value = PyString_FromStringAndSize(vbuf, vsiz);
+            PyList_SET_ITEM(pylist, i, value);
+        }
+    }
+    tclistdel(list);
+    
+    return pylist;
+}
+
+
+/*
+ * Like range, but return (key, value) tuples gathered in the same cursor
+ * pass rather than keys that each need another lookup.
+ */
+static PyObject *
+BTree_range_items(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *start, *stop, *pylist, *item;
+    int binc, einc, i, n;
+    int max = -1;
+    const char *kbuf, *vbuf;
+    int ksiz, vsiz;
+    TCLIST *keys, *vals;
+    BTreeWalk walk;
+    bool probe;
+    
+    static char *kwlist[] = {"bk", "binc", "ek", "einc", "max", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OiOi|i:range_items", kwlist,
+        &start, &binc, &stop, &einc, &max))
+    {
+        return NULL;
+    }
+    
+    if (btree_walkinit(&walk, self, start, stop, binc, einc, false))
+    {
+        return NULL;
+    }
+    
+    keys = tclistnew();
+    vals = tclistnew();
+    if (!keys || !vals)
+    {
+        if (keys)
+        {
+            tclistdel(keys);
+        }
+        btree_walkfree(&walk);
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memort for TCLIST object");
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    while ((max < 0 || tclistnum(keys) < max) && btree_walknext(&walk, true))
+    {
+        tclistpush(keys, tcxstrptr(walk.kxstr), tcxstrsize(walk.kxstr));
+        tclistpush(vals, tcxstrptr(walk.vxstr), tcxstrsize(walk.vxstr));
+    }
+    Py_END_ALLOW_THREADS
+    btree_probewalk(self, probe, &walk);
+    
+    btree_walkfree(&walk);
+    
+    n = tclistnum(keys);
+    pylist = PyList_New(n);
+    for (i=0; pylist && i<n; i++)
+    {
+        kbuf = tclistval(keys, i, &ksiz);
+        vbuf = tclistval(vals, i, &vsiz);
+        item = Py_BuildValue("(s#s#)", kbuf, ksiz, vbuf, vsiz);
+        if (!item)
+        {
+            Py_CLEAR(pylist);
+            break;
+        }
+        PyList_SET_ITEM(pylist, i, item);
+    }
+    tclistdel(keys);
+    tclistdel(vals);
+    
+    return pylist;
+}
+
+
+static PyObject *
+BTree_fwmkeys(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    char *pbuf;
+    int psiz, i, n;
+    int max = -1;
+    PyObject *pylist;
+    TCLIST *list;
+    
+    static char *kwlist[] = {"prefix", "max", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|i:fwmkeys", kwlist,
+        &pbuf, &psiz, &max))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    list = tcbdbfwmkeys(self->db, pbuf, psiz, max);
+    Py_END_ALLOW_THREADS
+    
+    if (!list)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memort for TCLIST object");
+        return NULL;
+    }
+    
+    n = tclistnum(list);
+    pylist = PyList_New(n);
+    if (pylist)
+    {
+        for (i=0; i<n; i++)
+        {
+            int vsiz;
+            const char *vbuf;
+            PyObject *value;
+            
+            vbuf = tclistval(list, i, &vsiz);
+            value = PyString_FromStringAndSize(vbuf, vsiz);
+            PyList_SET_ITEM(pylist, i, value);
+        }
+    }
+    tclistdel(list);
+    
+    return pylist;
+}
+
+
+static PyObject *
+BTree_irange(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *start = Py_None, *stop = Py_None;
+    PyObject *reverse = Py_False, *keys_only = Py_False, *values = NULL;
+    int binc = 1, einc = 0, batch = 100;
+    int rev, konly;
+    
+    static char *kwlist[] = {"start", "stop", "inclusive", "reverse", "batch",
+        "keys_only", "values", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO(ii)OiOO:irange", kwlist,
+        &start, &stop, &binc, &einc, &reverse, &batch, &keys_only, &values))
+    {
+        return NULL;
+    }
+    
+    if ((rev = PyObject_IsTrue(reverse)) < 0 ||
+        (konly = PyObject_IsTrue(keys_only)) < 0)
+    {
+        return NULL;
+    }
+    
+    /* values is the positive spelling of keys_only and wins if both are given. */
+    if (values)
+    {
+        int withval = PyObject_IsTrue(values);
+        
+        if (withval < 0)
+        {
+            return NULL;
+        }
+        konly = !withval;
+    }
+    
+    return btree_rangeiternew(self, start, stop, binc, einc, rev != 0,
+        konly ? BTREE_ITERKEYS : BTREE_ITERITEMS, batch);
+}
+
+
+/* Step through at most limit records of the range (all if limit < 0). */
+static PY_LONG_LONG
+btree_walkcount(BTreeWalk *walk, PY_LONG_LONG limit)
+{
+    PY_LONG_LONG count = 0;
+    
+    while ((limit < 0 || count < limit) && btree_walknext(walk, false))
+    {
+        count++;
+    }
+    return count;
+}
+
+
+static PyObject *
+BTree_count_range(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *start = Py_None, *stop = Py_None;
+    int binc = 1, einc = 0;
+    PY_LONG_LONG count;
+    BTreeWalk walk;
+    bool probe;
+    
+    static char *kwlist[] = {"start", "stop", "inclusive", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO(ii):count_range", kwlist,
+        &start, &stop, &binc, &einc))
+    {
+        return NULL;
+    }
+    
+    if (btree_walkinit(&walk, self, start, stop, binc, einc, false))
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    count = btree_walkcount(&walk, -1);
+    Py_END_ALLOW_THREADS
+    btree_probewalk(self, probe, &walk);
+    
+    btree_walkfree(&walk);
+    return PyLong_FromLongLong(count);
+}
+
+
+/*
+ * Place a key on a number line: the eight bytes after the prefix shared by
+ * the first and last keys of the database, read as a big-endian fraction.
+ */
+static double
+btree_keypos(const char *buf, int siz, int skip)
+{
+    int i;
+    double pos = 0.0;
+    
+    for (i=0; i<8; i++)
+    {
+        pos = pos * 256.0 + (skip + i < siz ? (unsigned char) buf[skip + i] : 0);
+    }
+    return pos;
+}
+
+
+static double
+btree_boundpos(const char *buf, int siz, TCXSTR *first, TCXSTR *last, int skip,
+    double fpos, double lpos)
+{
+    if (!buf || tccmplexical(buf, siz, tcxstrptr(first), tcxstrsize(first), NULL) <= 0)
+    {
+        return fpos;
+    }
+    if (tccmplexical(buf, siz, tcxstrptr(last), tcxstrsize(last), NULL) >= 0)
+    {
+        return lpos;
+    }
+    return btree_keypos(buf, siz, skip);
+}
+
+
+/*
+ * Count up to two leaves' worth of records exactly. Beyond that, and only
+ * under the lexical comparator, interpolate the bounds between the first and
+ * last keys of the database; other comparators fall back to counting.
+ */
+static PyObject *
+BTree_estimate_range(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *start = Py_None, *stop = Py_None;
+    int binc = 1, einc = 0, skip, fsiz, lsiz;
+    const char *fbuf, *lbuf;
+    PY_LONG_LONG count, limit, rnum, lnum;
+    double fpos, lpos, bpos, epos, estimate;
+    bool ends = false;
+    BTreeWalk walk;
+    
+    static char *kwlist[] = {"start", "stop", "inclusive", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO(ii):estimate_range", kwlist,
+        &start, &stop, &binc, &einc))
+    {
+        return NULL;
+    }
+    
+    if (btree_walkinit(&walk, self, start, stop, binc, einc, false))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    rnum = (PY_LONG_LONG) tcbdbrnum(self->db);
+    lnum = (PY_LONG_LONG) tcbdblnum(self->db);
+    limit = 2 * (lnum > 0 ? rnum / lnum + 1 : rnum);
+    if (walk.cmp != tccmplexical)
+    {
+        limit = -1;
+    }
+    count = btree_walkcount(&walk, limit);
+    
+    /* The walk's cursor is done with; reuse its buffers for the end keys. */
+    if (!walk.done && tcbdbcurfirst(walk.cur) &&
+        (fbuf = tcbdbcurkey3(walk.cur, &fsiz)) != NULL)
+    {
+        tcxstrclear(walk.kxstr);
+        tcxstrcat(walk.kxstr, fbuf, fsiz);
+        if (tcbdbcurlast(walk.cur) && (lbuf = tcbdbcurkey3(walk.cur, &lsiz)) != NULL)
+        {
+            tcxstrclear(walk.vxstr);
+            tcxstrcat(walk.vxstr, lbuf, lsiz);
+            ends = true;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    
+    if (!ends)
+    {
+        btree_walkfree(&walk);
+        return PyLong_FromLongLong(count);
+    }
+    
+    fbuf = tcxstrptr(walk.kxstr);
+    fsiz = tcxstrsize(walk.kxstr);
+    lbuf = tcxstrptr(walk.vxstr);
+    lsiz = tcxstrsize(walk.vxstr);
+    for (skip=0; skip<fsiz && skip<lsiz && fbuf[skip] == lbuf[skip]; skip++);
+    
+    fpos = btree_keypos(fbuf, fsiz, skip);
+    lpos = btree_keypos(lbuf, lsiz, skip);
+    bpos = btree_boundpos(walk.bkbuf, walk.bksiz, walk.kxstr, walk.vxstr, skip, fpos, lpos);
+    epos = walk.ekbuf ? btree_boundpos(walk.ekbuf, walk.eksiz, walk.kxstr, walk.vxstr,
+        skip, fpos, lpos) : lpos;
+    btree_walkfree(&walk);
+    
+    estimate = lpos > fpos ? rnum * (epos - bpos) / (lpos - fpos) : (double) rnum;
+    if (estimate < count)
+    {
+        estimate = count;
+    }
+    if (estimate > rnum)
+    {
+        estimate = rnum;
+    }
+    return PyLong_FromLongLong((PY_LONG_LONG) estimate);
+}
+
+
+#define BTREE_AGGCOUNT 0
+#define BTREE_AGGSUM 1
+#define BTREE_AGGMIN 2
+#define BTREE_AGGMAX 3
+#define BTREE_AGGAVG 4
+
+#define BTREE_VALDECIMAL 0
+#define BTREE_VALINT32 1
+#define BTREE_VALINT64 2
+#define BTREE_VALDOUBLE 3
+
+
+static const char *BTree_agg_names[] = {"count", "sum", "min", "max", "avg", NULL};
+static const char *BTree_val_names[] = {"decimal", "int32", "int64", "double", NULL};
+
+
+/*
+ * Sums stay exact integers until a value with a fraction turns up; a
+ * double running total is kept alongside for that case. The integer sum is
+ * kept in two words (isumhi * 2**64 + isumlo) so it cannot overflow.
+ */
+typedef struct
+{
+    PY_LONG_LONG count;
+    bool isint;
+    bool overflow;
+    unsigned PY_LONG_LONG isumlo;
+    PY_LONG_LONG isumhi;
+    PY_LONG_LONG imin, imax;
+    double dsum, dmin, dmax;
+} BTreeAgg;
+
+
+static int
+btree_namelookup(const char **names, PyObject *obj, const char *what)
+{
+    int i;
+    const char *name;
+    
+    if (!PyString_Check(obj))
+    {
+        PyErr_Format(PyExc_TypeError, "Expected %s to be a string.", what);
+        return -1;
+    }
+    
+    name = PyString_AS_STRING(obj);
+    for (i=0; names[i]; i++)
+    {
+        if (!strcmp(names[i], name))
+        {
+            return i;
+        }
+    }
+    
+    PyErr_Format(PyExc_ValueError, "Unknown %s: '%s'.", what, name);
+    return -1;
+}
+
+
+static void
+btree_aggint(BTreeAgg *agg, PY_LONG_LONG num)
+{
+    if (!agg->count || num < agg->imin)
+    {
+        agg->imin = num;
+    }
+    if (!agg->count || num > agg->imax)
+    {
+        agg->imax = num;
+    }
+    if (!agg->count || num < agg->dmin)
+    {
+        agg->dmin = (double) num;
+    }
+    if (!agg->count || num > agg->dmax)
+    {
+        agg->dmax = (double) num;
+    }
+    /* Add num, sign extended, to the two-word sum. */
+    agg->isumlo += (unsigned PY_LONG_LONG) num;
+    if (agg->isumlo < (unsigned PY_LONG_LONG) num)
+    {
+        agg->isumhi++;
+    }
+    if (num < 0)
+    {
+        agg->isumhi--;
+    }
+    agg->dsum += num;
+    agg->count++;
+}
+
+
+static void
+btree_aggdouble(BTreeAgg *agg, double num)
+{
+    if (!agg->count || num < agg->dmin)
+    {
+        agg->dmin = num;
+    }
+    if (!agg->count || num > agg->dmax)
+    {
+        agg->dmax = num;
+    }
+    agg->isint = false;
+    agg->dsum += num;
+    agg->count++;
+}
+
+
+/* Add one record's value; values that don't fit the type are skipped. */
+static void
+btree_aggadd(BTreeAgg *agg, int vtype, const char *vbuf, int vsiz)
+{
+    char num[64];
+    char *end;
+    int32_t i32;
+    int64_t i64;
+    double dbl;
+    
+    switch (vtype)
+    {
+        case BTREE_VALINT32:
+            if (vsiz == sizeof(i32))
+            {
+                memcpy(&i32, vbuf, sizeof(i32));
+                btree_aggint(agg, i32);
+            }
+            break;
+        
+        case BTREE_VALINT64:
+            if (vsiz == sizeof(i64))
+            {
+                memcpy(&i64, vbuf, sizeof(i64));
+                btree_aggint(agg, i64);
+            }
+            break;
+        
+        case BTREE_VALDOUBLE:
+            if (vsiz == sizeof(dbl))
+            {
+                memcpy(&dbl, vbuf, sizeof(dbl));
+                btree_aggdouble(agg, dbl);
+            }
+            break;
+        
+        default:
+            if (vsiz < 1 || vsiz >= (int) sizeof(num))
+            {
+                break;
+            }
+            memcpy(num, vbuf, vsiz);
+            num[vsiz] = '\0';
+            errno = 0;
+            i64 = strtoll(num, &end, 10);
+            if (*end == '\0')
+            {
+                if (errno == ERANGE)
+                {
+                    agg->overflow = true;
+                }
+                else
+                {
+                    btree_aggint(agg, i64);
+                }
+                break;
+            }
+            dbl = strtod(num, &end);
+            if (*end == '\0')
+            {
+                btree_aggdouble(agg, dbl);
+            }
+            break;
+    }
+}
+
+
+/* The exact integer sum, which may need more than 64 bits. */
+static PyObject *
+btree_aggisum(BTreeAgg *agg)
+{
+    PyObject *hi, *lo, *shift, *shifted, *sum;
+    
+    if ((agg->isumhi == 0 && agg->isumlo <= (unsigned PY_LONG_LONG) PY_LLONG_MAX) ||
+        (agg->isumhi == -1 && agg->isumlo > (unsigned PY_LONG_LONG) PY_LLONG_MAX))
+    {
+        return PyLong_FromLongLong((PY_LONG_LONG) agg->isumlo);
+    }
+    
+    hi = PyLong_FromLongLong(agg->isumhi);
+    lo = PyLong_FromUnsignedLongLong(agg->isumlo);
+    shift = PyInt_FromLong(64);
+    shifted = hi && shift ? PyNumber_Lshift(hi, shift) : NULL;
+    sum = shifted && lo ? PyNumber_Add(shifted, lo) : NULL;
+    Py_XDECREF(hi);
+    Py_XDECREF(lo);
+    Py_XDECREF(shift);
+    Py_XDECREF(shifted);
+    return sum;
+}
+
+
+static PyObject *
+btree_aggresult(BTreeAgg *agg, int fn)
+{
+    if (agg->overflow)
+    {
+        PyErr_SetString(PyExc_OverflowError,
+            "A decimal integer value in the range does not fit in 64 bits.");
+        return NULL;
+    }
+    
+    switch (fn)
+    {
+        case BTREE_AGGCOUNT:
+            return PyLong_FromLongLong(agg->count);
+        
+        case BTREE_AGGSUM:
+            return agg->isint ? btree_aggisum(agg) : PyFloat_FromDouble(agg->dsum);
+        
+        case BTREE_AGGAVG:
+            if (!agg->count)
+            {
+                Py_RETURN_NONE;
+            }
+            return PyFloat_FromDouble(agg->dsum / agg->count);
+        
+        default:
+            if (!agg->count)
+            {
+                Py_RETURN_NONE;
+            }
+            if (agg->isint)
+            {
+                return PyLong_FromLongLong(fn == BTREE_AGGMIN ? agg->imin : agg->imax);
+            }
+            return PyFloat_FromDouble(fn == BTREE_AGGMIN ? agg->dmin : agg->dmax);
+    }
+}
+
+
+/* A single function gives its value, a sequence of them a dict. */
+static PyObject *
+btree_aggresults(BTreeAgg *agg, int *fns, int fnum, bool single)
+{
+    int i;
+    PyObject *dict, *value;
+    
+    if (single)
+    {
+        return btree_aggresult(agg, fns[0]);
+    }
+    
+    dict = PyDict_New();
+    if (!dict)
+    {
+        return NULL;
+    }
+    
+    for (i=0; i<fnum; i++)
+    {
+        value = btree_aggresult(agg, fns[i]);
+        if (!value || PyDict_SetItemString(dict, BTree_agg_names[fns[i]], value))
+        {
+            Py_XDECREF(value);
+            Py_DECREF(dict);
+            return NULL;
+        }
+        Py_DECREF(value);
+    }
+    return dict;
+}
+
+
+/*
+ * Aggregate the values of a range in one native walk. With group > 0 the
+ * records are grouped by the first group bytes of their keys and a list of
+ * (prefix, result) pairs is returned in key order.
+ */
+static PyObject *
+BTree_aggregate(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *start = Py_None, *stop = Py_None, *fn = NULL, *vtobj = NULL;
+    PyObject *fast = NULL, *result = NULL, *item;
+    int binc = 1, einc = 0, group = 0;
+    int fns[5], fnum, vtype = BTREE_VALDECIMAL, i, gnum = 0, gcap = 0;
+    int gsiz, psiz;
+    const char *kbuf, *pbuf;
+    bool single, newgroup, failed = false, probe;
+    BTreeAgg *aggs = NULL;
+    TCLIST *prefixes;
+    BTreeWalk walk;
+    
+    static char *kwlist[] = {"start", "stop", "fn", "value_type", "inclusive", "group", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOOO(ii)i:aggregate", kwlist,
+        &start, &stop, &fn, &vtobj, &binc, &einc, &group))
+    {
+        return NULL;
+    }
+    
+    single = !fn || PyString_Check(fn);
+    if (!fn)
+    {
+        fns[0] = BTREE_AGGSUM;
+        fnum = 1;
+    }
+    else if (single)
+    {
+        if ((fns[0] = btree_namelookup(BTree_agg_names, fn, "aggregate function")) < 0)
+        {
+            return NULL;
+        }
+        fnum = 1;
+    }
+    else
+    {
+        fast = PySequence_Fast(fn, "Expected fn to be a string or a sequence of strings.");
+        if (!fast)
+        {
+            return NULL;
+        }
+        fnum = (int) PySequence_Fast_GET_SIZE(fast);
+        if (fnum < 1 || fnum > 5)
+        {
+            Py_DECREF(fast);
+            PyErr_SetString(PyExc_ValueError, "Expected one to five aggregate functions.");
+            return NULL;
+        }
+        for (i=0; i<fnum; i++)
+        {
+            fns[i] = btree_namelookup(BTree_agg_names, PySequence_Fast_GET_ITEM(fast, i),
+                "aggregate function");
+            if (fns[i] < 0)
+            {
+                Py_DECREF(fast);
+                return NULL;
+            }
+        }
+        Py_DECREF(fast);
+    }
+    
+    if (vtobj && (vtype = btree_namelookup(BTree_val_names, vtobj, "value type")) < 0)
+    {
+        return NULL;
+    }
+    
+    if (group < 0)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected group to be non-negative.");
+        return NULL;
+    }
+    
+    prefixes = tclistnew();
+    if (!prefixes)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memory for TCLIST object");
+        return NULL;
+    }
+    
+    if (btree_walkinit(&walk, self, start, stop, binc, einc, false))
+    {
+        tclistdel(prefixes);
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    while (btree_walknext(&walk, true))
+    {
+        kbuf = tcxstrptr(walk.kxstr);
+        gsiz = tcxstrsize(walk.kxstr);
+        gsiz = gsiz < group ? gsiz : group;
+        
+        newgroup = !gnum;
+        if (!newgroup && group > 0)
+        {
+            pbuf = tclistval(prefixes, gnum - 1, &psiz);
+            newgroup = psiz != gsiz || memcmp(pbuf, kbuf, gsiz);
+        }
+        
+        if (newgroup)
+        {
+            if (gnum == gcap)
+            {
+                BTreeAgg *grown;
+                
+                gcap = gcap ? gcap * 2 : 16;
+                grown = (BTreeAgg *) realloc(aggs, gcap * sizeof(BTreeAgg));
+                if (!grown)
+                {
+                    failed = true;
+                    break;
+                }
+                aggs = grown;
+            }
+            memset(&aggs[gnum], 0, sizeof(BTreeAgg));
+            aggs[gnum].isint = vtype != BTREE_VALDOUBLE;
+            tclistpush(prefixes, kbuf, gsiz);
+            gnum++;
+        }
+        
+        btree_aggadd(&aggs[gnum - 1], vtype, tcxstrptr(walk.vxstr), tcxstrsize(walk.vxstr));
+    }
+    Py_END_ALLOW_THREADS
+    btree_probewalk(self, probe, &walk);
+    
+    btree_walkfree(&walk);
+    
+    if (failed)
+    {
+        PyErr_NoMemory();
+    }
+    else if (!group)
+    {
+        BTreeAgg empty;
+        
+        memset(&empty, 0, sizeof(empty));
+        empty.isint = vtype != BTREE_VALDOUBLE;
+        result = btree_aggresults(gnum ? &aggs[0] : &empty, fns, fnum, single);
+    }
+    else if ((result = PyList_New(gnum)))
+    {
+        for (i=0; i<gnum; i++)
+        {
+            PyObject *value;
+            
+            pbuf = tclistval(prefixes, i, &psiz);
+            value = btree_aggresults(&aggs[i], fns, fnum, single);
+            item = value ? Py_BuildValue("(s#N)", pbuf, psiz, value) : NULL;
+            if (!item)
+            {
+                Py_CLEAR(result);
+                break;
+            }
+            PyList_SET_ITEM(result, i, item);
+        }
+    }
+    
+    free(aggs);
+    tclistdel(prefixes);
+    return result;
+}
+
+
+static PyObject *
+BTree_addint(BTree *self, PyObject *args)
+{
+    char *kbuf;
+    int ksiz, num, result;
+    
+    if (!PyArg_ParseTuple(args, "s#i:addint", &kbuf, &ksiz, &num))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    result = tcbdbaddint(self->db, kbuf, ksiz, num);
+    Py_END_ALLOW_THREADS
+    
+    return PyInt_FromLong((long) result);
+}
+
+
+static PyObject *
+BTree_adddouble(BTree *self, PyObject *args)
+{
+    char *kbuf;
+    int ksiz;
+    double num, result;
+    
+    if (!PyArg_ParseTuple(args, "s#d:adddouble", &kbuf, &ksiz, &num))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    result = tcbdbadddouble(self->db, kbuf, ksiz, num);
+    Py_END_ALLOW_THREADS
+    
+    return PyFloat_FromDouble(result);
+}
+
+
+static PyObject *
+BTree_sync(BTree *self)
+{
+    bool success;
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbsync(self->db);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_optimize(BTree *self, PyObject *args, PyObject *kwargs)
+{
+    bool success = 0;
+    int lmemb, nmemb;
+    lmemb = nmemb = 0;
+    PY_LONG_LONG bnum = 0;
+    short apow, bpow;
+    apow = bpow = -1;
+    unsigned char opts = UCHAR_MAX;
+    
+    static char *kwlist[] = {"lmemb", "nmemb", "bnum", "apow", "bpow", "opts", NULL };
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iiLhhB:tune", kwlist, 
+        &lmemb, &nmemb, &bnum, &apow, &bpow, &opts))
+    {
+        return NULL;
+    }
+    
+    if (apow < SCHAR_MIN || apow > SCHAR_MAX ||
+        bpow < SCHAR_MIN || bpow > SCHAR_MAX)
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdboptimize(self->db, lmemb, nmemb, bnum, apow, bpow, opts);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_vanish(BTree *self)
+{
+    bool success;
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbvanish(self->db);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_copy(BTree *self, PyObject *args)
+{
+    bool success;
+    char *path;
+    
+    if (!PyArg_ParseTuple(args, "s", &path))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbcopy(self->db, path);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_tranbegin(BTree *self)
+{
+    bool success;
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbtranbegin(self->db);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    self->tran = true;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_trancommit(BTree *self)
+{
+    bool success;
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbtrancommit(self->db);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    self->tran = false;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_tranabort(BTree *self)
+{
+    bool success;
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbtranabort(self->db);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    self->tran = false;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_path(BTree *self)
+{
+    const char *path;
+    
+    Py_BEGIN_ALLOW_THREADS
+    path = tcbdbpath(self->db);
+    Py_END_ALLOW_THREADS
+    
+    if (!path)
+    {
+        Py_RETURN_NONE;
+    }
+    
+    return PyString_FromString(path);
+}
+
+
+static PyObject *
+BTree_rnum(BTree *self)
+{
+    uint64_t rnum;
+    
+    Py_BEGIN_ALLOW_THREADS
+    rnum = tcbdbrnum(self->db);
+    Py_END_ALLOW_THREADS
+    
+    return PyLong_FromLongLong(rnum);
+}
+
+
+static PyObject *
+BTree_fsiz(BTree *self)
+{
+    uint64_t fsiz;
+    
+    Py_BEGIN_ALLOW_THREADS
+    fsiz = tcbdbfsiz(self->db);
+    Py_END_ALLOW_THREADS
+    
+    return PyLong_FromLongLong(fsiz);
+}
+
+
+static PyObject *
+BTree_reduce(BTree *self)
+{
+    PyObject *delim;
+    
+    if (!self->path)
+    {
+        return Py_BuildValue("(O())", (PyObject *) self->ob_type);
+    }
+    
+    if (self->builtin < 0)
+    {
+        PyErr_SetString(PyExc_TypeError,
+            "Cannot pickle a BTree using a Python comparison function.");
+        return NULL;
+    }
+    
+    if (self->cmpspec && self->cmpspec->delim >= 0)
+    {
+        char c = (char) self->cmpspec->delim;
+        delim = PyString_FromStringAndSize(&c, 1);
+    }
+    else
+    {
+        Py_INCREF(Py_None);
+        delim = Py_None;
+    }
+    
+    if (!delim)
+    {
+        return NULL;
+    }
+    
+    return Py_BuildValue("(O()(siiON))", (PyObject *) self->ob_type,
+        self->path, (self->omode & ~(BDBOWRITER | BDBOCREAT | BDBOTRUNC)) | BDBOREADER, self->builtin,
+        self->cmpfields ? self->cmpfields : Py_None, delim);
+}
+
+
+static PyObject *
+BTree_setstate(BTree *self, PyObject *state)
+{
+    bool success;
+    char *path;
+    int omode, builtin;
+    PyObject *fields, *delim;
+    
+    if (!PyArg_ParseTuple(state, "siiOO:__setstate__", &path, &omode, &builtin,
+        &fields, &delim))
+    {
+        return NULL;
+    }
+    
+    if (builtin < 0 || builtin >= BTREE_NBUILTIN)
+    {
+        PyErr_SetString(BTreeError, "Unknown comparison function in pickled state.");
+        return NULL;
+    }
+    
+    if ((builtin > 0 || fields != Py_None) &&
+        !BTree_setnativecmp(self, builtin, fields, delim))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbopen(self->db, path, omode);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    BTree_setopened(self, path, omode);
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+BTree_cursor(BTree *self)
+{
+    PyObject *pycur;
+    PyObject *args;
+    
+    args = Py_BuildValue("(O)", self);
+    pycur = BTreeCursor_new(&BTreeCursorType, args, NULL);
+    Py_DECREF(args);
+    
+    if (!pycur)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    return pycur;
+}
+
+
+static int
+BTree_length(BTree *self)
+{
+    uint64_t rnum;
+    
+    if (BTree_checkfork(self))
+    {
+        return -1;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    rnum = tcbdbrnum(self->db);
+    Py_END_ALLOW_THREADS
+    
+    return (int) rnum;
+}
+
+
+static PyObject *
+BTree_subscript(BTree *self, PyObject *key)
+{
+    bool probe;
+    char *kbuf, *vbuf;
+    Py_ssize_t ksiz;
+    Py_ssize_t vsiz;
+    PyObject *value;
+    int tcvsiz;
+    
+    if (BTree_checkfork(self))
+    {
+        return NULL;
+    }
+    
+    if (!PyString_Check(key))
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected key to be a string.");
+        return NULL;
+    }
+    
+    PyString_AsStringAndSize(key, &kbuf, &ksiz);
+    
+    if (!kbuf)
+    {
+        return NULL;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    vbuf = tcbdbget(self->db, kbuf, (int) ksiz, &tcvsiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    vsiz = tcvsiz;
+
+    if (!vbuf)
+    {
+        raise_btree_error(self->db);
+        return NULL;
+    }
+    
+    value = PyString_FromStringAndSize(vbuf, vsiz);
+    free(vbuf);
+    
+    if (!value)
+    {
+        return NULL;
+    }
+    
+    return value;
+}
+
+
+static int
+BTree_ass_subscript(BTree *self, PyObject *key, PyObject *value)
+{
+    bool probe;
+    bool success;
+    char *kbuf, *vbuf;
+    Py_ssize_t ksiz, vsiz;
+    
+    if (BTree_checkfork(self))
+    {
+        return -1;
+    }
+    
+    if (!PyString_Check(key))
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected key to be a string.");
+        return -1;
+    }
+    
+    if (!PyString_Check(value))
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected value to be a string.");
+        return -1;
+    }
+    
+    PyString_AsStringAndSize(key, &kbuf, &ksiz);
+    if (!kbuf)
+    {
+        return -1;
+    }
+    
+    PyString_AsStringAndSize(value, &vbuf, &vsiz);
+    if (!vbuf)
+    {
+        return -1;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    success = tcbdbput(self->db, kbuf, (int) ksiz, vbuf, (int) vsiz);
+    Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    if (!success)
+    {
+        raise_btree_error(self->db);
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+static PyMappingMethods BTree_as_mapping = 
+{
+#if PY_VERSION_HEX < 0x02050000
+    (inquiry) BTree_length,
+#else
+    (lenfunc) BTree_length,
+#endif
+    (binaryfunc) BTree_subscript,
+    (objobjargproc) BTree_ass_subscript
+};
+
+
+static int
+BTree_contains(BTree *self, PyObject *value)
+{
+    bool probe;
+    char *kbuf;
+    Py_ssize_t ksiz;
+    Py_ssize_t vsiz;
+    
+    if (BTree_checkfork(self))
+    {
+        return -1;
+    }
+    
+    if (!PyString_Check(value))
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected value to be a string");
+        return -1;
+    }
+    
+    PyString_AsStringAndSize(value, &kbuf, &ksiz);
+    if (!kbuf)
+    {
+        return -1;
+    }
+    
+    probe = btree_probebegin(self);
+    Py_BEGIN_ALLOW_THREADS
+    vsiz = tcbdbvsiz(self->db, kbuf, (int) ksiz);
     Py_END_ALLOW_THREADS
+    btree_probeend(self, probe, 1, 1);
+    
+    return vsiz != -1;
+}
+
+
+static PySequenceMethods BTree_as_sequence = 
+{
+    0,                             /* sq_length */
+    0,                             /* sq_concat */
+    0,                             /* sq_repeat */
+    0,                             /* sq_item */
+    0,                             /* sq_slice */
+    0,                             /* sq_ass_item */
+    0,                             /* sq_ass_slice */
+    (objobjproc) BTree_contains,   /* sq_contains */
+    0,                             /* sq_inplace_concat */
+    0                              /* sq_inplace_repeat */
+};
+
+
+/*
+ * Sorted table files, written by BTree.export_sorted and read by
+ * SortedTable. The file is immutable once written:
+ *
+ *   "TCSTBL01"
+ *   data blocks   entries of varint shared key bytes, varint unshared key
+ *                 bytes, varint value size, the unshared key bytes and the
+ *                 value; every block starts with a full key
+ *   index         per block: varint key size, first key, 64-bit offset,
+ *                 32-bit size, 32-bit entry count
+ *   bloom filter  optional, bloom_k probes per key by double hashing
+ *   footer        64-bit index offset, index size, bloom offset, bloom size
+ *                 and record count, 32-bit block count and bloom_k, magic
+ *
+ * Integers in the index and footer are little-endian. Keys are ordered
+ * bytewise, so only databases using the lexical comparator are exported.
+ */
+#define BTREE_SSTMAGIC "TCSTBL01"
+#define BTREE_SSTMAGICSIZ 8
+#define BTREE_SSTFOOTSIZ (5 * 8 + 2 * 4 + BTREE_SSTMAGICSIZ)
+#define BTREE_SSTIDXENT (8 + 4 + 4)
+
+
+static uint64_t
+btree_sshash(const char *buf, int siz)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int i;
     
-    return Py_BuildValue("i", vsiz);
+    for (i=0; i<siz; i++)
+    {
+        hash ^= (unsigned char) buf[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static void
+btree_xstrvarint(TCXSTR *xstr, uint64_t num)
+{
+    unsigned char buf[10];
+    int len = 0;
+    
+    do
+    {
+        buf[len] = num & 0x7f;
+        num >>= 7;
+        if (num)
+        {
+            buf[len] |= 0x80;
+        }
+        len++;
+    } while (num);
+    tcxstrcat(xstr, buf, len);
+}
+
+
+static void
+btree_xstrfixed(TCXSTR *xstr, uint64_t num, int len)
+{
+    unsigned char buf[8];
+    int i;
+    
+    for (i=0; i<len; i++)
+    {
+        buf[i] = (num >> (8 * i)) & 0xff;
+    }
+    tcxstrcat(xstr, buf, len);
+}
+
+
+static uint64_t
+btree_readfixed(const unsigned char *buf, int len)
+{
+    uint64_t num = 0;
+    int i;
+    
+    for (i=len-1; i>=0; i--)
+    {
+        num = (num << 8) | buf[i];
+    }
+    return num;
+}
+
+
+/* Decode a varint, returning false if it runs past end. */
+static bool
+btree_readvarint(const unsigned char **pos, const unsigned char *end, uint64_t *num)
+{
+    int shift = 0;
+    
+    *num = 0;
+    while (*pos < end && shift < 64)
+    {
+        unsigned char c = *(*pos)++;
+        *num |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            return true;
+        }
+        shift += 7;
+    }
+    return false;
+}
+
+
+typedef struct
+{
+    FILE *fp;
+    uint64_t off;
+    int blocksiz;
+    TCXSTR *block;
+    TCXSTR *index;
+    TCXSTR *prev;
+    uint32_t bcount;
+    uint32_t nblocks;
+    uint64_t rnum;
+    unsigned char *bloom;
+    uint64_t bloombits;
+    int bloomk;
+} BTreeSSTWriter;
+
+
+static bool
+btree_sstwrite(BTreeSSTWriter *w, const void *buf, size_t siz)
+{
+    if (siz && fwrite(buf, 1, siz, w->fp) != siz)
+    {
+        return false;
+    }
+    w->off += siz;
+    return true;
+}
+
+
+static bool
+btree_sstflush(BTreeSSTWriter *w)
+{
+    if (!w->bcount)
+    {
+        return true;
+    }
+    
+    btree_xstrfixed(w->index, w->off, 8);
+    btree_xstrfixed(w->index, tcxstrsize(w->block), 4);
+    btree_xstrfixed(w->index, w->bcount, 4);
+    w->nblocks++;
+    
+    if (!btree_sstwrite(w, tcxstrptr(w->block), tcxstrsize(w->block)))
+    {
+        return false;
+    }
+    tcxstrclear(w->block);
+    tcxstrclear(w->prev);
+    w->bcount = 0;
+    return true;
+}
+
+
+static bool
+btree_sstadd(BTreeSSTWriter *w, const char *kbuf, int ksiz, const char *vbuf, int vsiz)
+{
+    const char *pbuf = tcxstrptr(w->prev);
+    int psiz = tcxstrsize(w->prev);
+    int shared = 0;
+    uint64_t hash, h1, h2, bit;
+    int i;
+    
+    if (!w->bcount)
+    {
+        btree_xstrvarint(w->index, ksiz);
+        tcxstrcat(w->index, kbuf, ksiz);
+    }
+    else
+    {
+        while (shared < psiz && shared < ksiz && pbuf[shared] == kbuf[shared])
+        {
+            shared++;
+        }
+    }
+    
+    btree_xstrvarint(w->block, shared);
+    btree_xstrvarint(w->block, ksiz - shared);
+    btree_xstrvarint(w->block, vsiz);
+    tcxstrcat(w->block, kbuf + shared, ksiz - shared);
+    tcxstrcat(w->block, vbuf, vsiz);
+    tcxstrclear(w->prev);
+    tcxstrcat(w->prev, kbuf, ksiz);
+    w->bcount++;
+    w->rnum++;
+    
+    if (w->bloom)
+    {
+        hash = btree_sshash(kbuf, ksiz);
+        h1 = hash & 0xffffffff;
+        h2 = (hash >> 32) | 1;
+        for (i=0; i<w->bloomk; i++)
+        {
+            bit = (h1 + i * h2) % w->bloombits;
+            w->bloom[bit / 8] |= 1 << (bit % 8);
+        }
+    }
+    
+    return tcxstrsize(w->block) < w->blocksiz || btree_sstflush(w);
+}
+
+
+static bool
+btree_sstfinish(BTreeSSTWriter *w)
+{
+    uint64_t idxoff, idxsiz, bloomoff, bloomsiz;
+    TCXSTR *foot;
+    bool ok;
+    
+    if (!btree_sstflush(w))
+    {
+        return false;
+    }
+    
+    idxoff = w->off;
+    idxsiz = tcxstrsize(w->index);
+    if (!btree_sstwrite(w, tcxstrptr(w->index), idxsiz))
+    {
+        return false;
+    }
+    
+    bloomoff = w->off;
+    bloomsiz = w->bloom ? (w->bloombits + 7) / 8 : 0;
+    if (!btree_sstwrite(w, w->bloom, bloomsiz))
+    {
+        return false;
+    }
+    
+    foot = tcxstrnew();
+    if (!foot)
+    {
+        return false;
+    }
+    btree_xstrfixed(foot, idxoff, 8);
+    btree_xstrfixed(foot, idxsiz, 8);
+    btree_xstrfixed(foot, bloomoff, 8);
+    btree_xstrfixed(foot, bloomsiz, 8);
+    btree_xstrfixed(foot, w->rnum, 8);
+    btree_xstrfixed(foot, w->nblocks, 4);
+    btree_xstrfixed(foot, w->bloomk, 4);
+    tcxstrcat(foot, BTREE_SSTMAGIC, BTREE_SSTMAGICSIZ);
+    ok = btree_sstwrite(w, tcxstrptr(foot), tcxstrsize(foot));
+    tcxstrdel(foot);
+    return ok;
 }
 
 
+/*
+ * Write every record to a new sorted table file. The file is written under
+ * a temporary name and renamed into place, so readers never see a partial
+ * table.
+ */
 static PyObject *
-BTree_range(BTree *self, PyObject *args, PyObject *kwargs)
+BTree_export_sorted(BTree *self, PyObject *args, PyObject *kwargs)
 {
-    char *bkbuf, *ekbuf;
-    int bksiz, eksiz, binc, einc, i, n;
-    int max = -1;
-    PyObject *pylist;
-    TCLIST *list;
+    char *path, *tmppath;
+    int bloom_bits = 10, block_size = 4096;
+    int err = 0;
+    bool ok, probe;
+    uint64_t rnum;
+    BTreeSSTWriter w;
+    BTreeWalk walk;
     
-    static char *kwlist[] = {"bk", "binc", "ek", "einc", "max", NULL};
+    static char *kwlist[] = {"path", "bloom_bits", "block_size", NULL};
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#is#i|i:range", kwlist,
-        &bkbuf, &bksiz, &binc, &ekbuf, &eksiz, &einc, &max))
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|ii:export_sorted", kwlist,
+        &path, &bloom_bits, &block_size))
+    {
+        return NULL;
+    }
+    
+    if (tcbdbcmpfunc(self->db) != tccmplexical)
+    {
+        PyErr_SetString(PyExc_ValueError, "Only databases using the lexical comparator can be exported.");
+        return NULL;
+    }
+    
+    if (bloom_bits < 0 || block_size < 64)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected bloom_bits >= 0 and block_size >= 64.");
+        return NULL;
+    }
+    
+    tmppath = (char *) malloc(strlen(path) + 5);
+    if (!tmppath)
+    {
+        return PyErr_NoMemory();
+    }
+    sprintf(tmppath, "%s.tmp", path);
+    
+    if (btree_walkinit(&walk, self, NULL, NULL, 1, 1, false))
     {
+        free(tmppath);
         return NULL;
     }
     
+    memset(&w, 0, sizeof(w));
+    w.blocksiz = block_size;
+    w.block = tcxstrnew();
+    w.index = tcxstrnew();
+    w.prev = tcxstrnew();
+    
+    probe = btree_probebegin(self);
     Py_BEGIN_ALLOW_THREADS
-    list = tcbdbrange(self->db, bkbuf, bksiz, binc, ekbuf, eksiz, einc, max);
+    rnum = tcbdbrnum(self->db);
+    if (bloom_bits > 0)
+    {
+        w.bloombits = rnum * bloom_bits < 64 ? 64 : rnum * bloom_bits;
+        w.bloomk = (int) (bloom_bits * 0.69 + 0.5);
+        w.bloomk = w.bloomk < 1 ? 1 : w.bloomk > 30 ? 30 : w.bloomk;
+        w.bloom = (unsigned char *) calloc((w.bloombits + 7) / 8, 1);
+    }
+    
+    ok = w.block && w.index && w.prev && (bloom_bits == 0 || w.bloom);
+    if (ok)
+    {
+        w.fp = fopen(tmppath, "wb");
+        ok = w.fp && btree_sstwrite(&w, BTREE_SSTMAGIC, BTREE_SSTMAGICSIZ);
+    }
+    
+    while (ok && btree_walknext(&walk, true))
+    {
+        ok = btree_sstadd(&w, tcxstrptr(walk.kxstr), tcxstrsize(walk.kxstr),
+            tcxstrptr(walk.vxstr), tcxstrsize(walk.vxstr));
+    }
+    
+    ok = ok && btree_sstfinish(&w);
+    if (!ok)
+    {
+        err = errno ? errno : ENOMEM;
+    }
+    if (w.fp && fclose(w.fp) && ok)
+    {
+        err = errno;
+        ok = false;
+    }
+    if (ok && rename(tmppath, path))
+    {
+        err = errno;
+        ok = false;
+    }
+    if (!ok && w.fp)
+    {
+        unlink(tmppath);
+    }
     Py_END_ALLOW_THREADS
+    btree_probewalk(self, probe, &walk);
     
-    if (!list)
+    btree_walkfree(&walk);
+    if (w.block)
     {
-        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memort for TCLIST object");
-        return NULL;
+        tcxstrdel(w.block);
+    }
+    if (w.index)
+    {
+        tcxstrdel(w.index);
+    }
+    if (w.prev)
+    {
+        tcxstrdel(w.prev);
     }
+    free(w.bloom);
+    free(tmppath);
     
-    n = tclistnum(list);
-    pylist = PyList_New(n);
-    if (pylist)
+    if (!ok)
     {
-        for (i=0; i<n; i++)
+        errno = err;
+        return PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    }
+    return PyLong_FromUnsignedLongLong(w.rnum);
+}
+
+
+typedef struct
+{
+    PyObject_HEAD
+    char *path;
+    const unsigned char *map;
+    size_t msiz;
+    uint32_t nblocks;
+    uint64_t rnum;
+    const unsigned char **bkeys;
+    int *bksizs;
+    const unsigned char **bdata;
+    uint32_t *bsizs;
+    uint32_t *bcounts;
+    const unsigned char *bloom;
+    uint64_t bloombits;
+    int bloomk;
+    Py_ssize_t exports;
+} SortedTable;
+
+
+static PyTypeObject SortedTableType;
+
+
+static void
+SortedTable_unmap(SortedTable *self)
+{
+    if (self->map)
+    {
+        munmap((void *) self->map, self->msiz);
+        self->map = NULL;
+    }
+    free(self->bkeys);
+    free(self->bksizs);
+    free(self->bdata);
+    free(self->bsizs);
+    free(self->bcounts);
+    self->bkeys = NULL;
+    self->bksizs = NULL;
+    self->bdata = NULL;
+    self->bsizs = NULL;
+    self->bcounts = NULL;
+}
+
+
+static void
+SortedTable_dealloc(SortedTable *self)
+{
+    SortedTable_unmap(self);
+    free(self->path);
+    self->ob_type->tp_free(self);
+}
+
+
+static PyObject *
+sortedtable_corrupt(SortedTable *self)
+{
+    PyErr_Format(BTreeError, "Corrupt sorted table: %s", self->path ? self->path : "?");
+    return NULL;
+}
+
+
+/* Map the file and decode its footer and index. */
+static int
+SortedTable_load(SortedTable *self)
+{
+    const unsigned char *foot, *pos, *end;
+    uint64_t idxoff, idxsiz, bloomoff, bloomsiz, ksiz;
+    uint32_t i;
+    struct stat sbuf;
+    void *map;
+    int fd;
+    
+    fd = open(self->path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sbuf))
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, self->path);
+        if (fd >= 0)
         {
-            int vsiz;
-            const char *vbuf;
-            PyObject *value;
-            
-            vbuf = tclistval(list, i, &vsiz);
-            value = PyString_FromStringAndSize(vbuf, vsiz);
-            PyList_SET_ITEM(pylist, i, value);
+            close(fd);
+        }
+        return -1;
+    }
+    
+    if (sbuf.st_size < BTREE_SSTMAGICSIZ + BTREE_SSTFOOTSIZ)
+    {
+        close(fd);
+        sortedtable_corrupt(self);
+        return -1;
+    }
+    
+    map = mmap(NULL, sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, self->path);
+        return -1;
+    }
+    self->map = (const unsigned char *) map;
+    self->msiz = sbuf.st_size;
+    
+    foot = self->map + self->msiz - BTREE_SSTFOOTSIZ;
+    if (memcmp(self->map, BTREE_SSTMAGIC, BTREE_SSTMAGICSIZ) ||
+        memcmp(foot + BTREE_SSTFOOTSIZ - BTREE_SSTMAGICSIZ, BTREE_SSTMAGIC, BTREE_SSTMAGICSIZ))
+    {
+        sortedtable_corrupt(self);
+        return -1;
+    }
+    
+    idxoff = btree_readfixed(foot, 8);
+    idxsiz = btree_readfixed(foot + 8, 8);
+    bloomoff = btree_readfixed(foot + 16, 8);
+    bloomsiz = btree_readfixed(foot + 24, 8);
+    self->rnum = btree_readfixed(foot + 32, 8);
+    self->nblocks = (uint32_t) btree_readfixed(foot + 40, 4);
+    self->bloomk = (int) btree_readfixed(foot + 44, 4);
+    
+    if (idxoff > self->msiz || idxsiz > self->msiz - idxoff ||
+        bloomoff > self->msiz || bloomsiz > self->msiz - bloomoff ||
+        self->nblocks > idxsiz / BTREE_SSTIDXENT)
+    {
+        sortedtable_corrupt(self);
+        return -1;
+    }
+    
+    if (bloomsiz > 0 && self->bloomk > 0)
+    {
+        self->bloom = self->map + bloomoff;
+        self->bloombits = bloomsiz * 8;
+    }
+    
+    self->bkeys = (const unsigned char **) malloc((self->nblocks + 1) * sizeof(char *));
+    self->bksizs = (int *) malloc((self->nblocks + 1) * sizeof(int));
+    self->bdata = (const unsigned char **) malloc((self->nblocks + 1) * sizeof(char *));
+    self->bsizs = (uint32_t *) malloc((self->nblocks + 1) * sizeof(uint32_t));
+    self->bcounts = (uint32_t *) malloc((self->nblocks + 1) * sizeof(uint32_t));
+    if (!self->bkeys || !self->bksizs || !self->bdata || !self->bsizs || !self->bcounts)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    
+    pos = self->map + idxoff;
+    end = pos + idxsiz;
+    for (i=0; i<self->nblocks; i++)
+    {
+        uint64_t boff, bsiz;
+        
+        if (!btree_readvarint(&pos, end, &ksiz) || ksiz > (uint64_t) (end - pos) ||
+            (uint64_t) (end - pos) - ksiz < BTREE_SSTIDXENT)
+        {
+            sortedtable_corrupt(self);
+            return -1;
+        }
+        self->bkeys[i] = pos;
+        self->bksizs[i] = (int) ksiz;
+        pos += ksiz;
+        boff = btree_readfixed(pos, 8);
+        bsiz = btree_readfixed(pos + 8, 4);
+        self->bcounts[i] = (uint32_t) btree_readfixed(pos + 12, 4);
+        pos += BTREE_SSTIDXENT;
+        
+        if (boff > idxoff || bsiz > idxoff - boff)
+        {
+            sortedtable_corrupt(self);
+            return -1;
+        }
+        self->bdata[i] = self->map + boff;
+        self->bsizs[i] = (uint32_t) bsiz;
+    }
+    
+    return 0;
+}
+
+
+static PyObject *
+SortedTable_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    SortedTable *self;
+    char *path;
+    static char *kwlist[] = { "path", NULL };
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s", kwlist, &path))
+    {
+        return NULL;
+    }
+    
+    self = (SortedTable *) type->tp_alloc(type, 0);
+    if (!self)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate SortedTable instance.");
+        return NULL;
+    }
+    
+    self->path = strdup(path);
+    if (!self->path || SortedTable_load(self))
+    {
+        if (!PyErr_Occurred())
+        {
+            PyErr_NoMemory();
         }
+        SortedTable_dealloc(self);
+        return NULL;
     }
-    tclistdel(list);
     
-    return pylist;
+    return (PyObject *) self;
+}
+
+
+static int
+SortedTable_getbuffer(SortedTable *self, Py_buffer *view, int flags)
+{
+    if (!self->map)
+    {
+        PyErr_SetString(PyExc_BufferError, "The sorted table is closed.");
+        return -1;
+    }
+    if (PyBuffer_FillInfo(view, (PyObject *) self, (void *) self->map, self->msiz, 1, flags))
+    {
+        return -1;
+    }
+    self->exports++;
+    return 0;
+}
+
+
+static void
+SortedTable_releasebuffer(SortedTable *self, Py_buffer *view)
+{
+    self->exports--;
 }
 
 
+/* A read-only memoryview of part of the mapping, which keeps the table alive. */
 static PyObject *
-BTree_fwmkeys(BTree *self, PyObject *args, PyObject *kwargs)
+sortedtable_view(SortedTable *self, const unsigned char *buf, Py_ssize_t siz)
 {
-    char *pbuf;
-    int psiz, i, n;
-    int max = -1;
-    PyObject *pylist;
-    TCLIST *list;
+    Py_buffer view;
+    PyObject *mview;
     
-    static char *kwlist[] = {"prefix", "max", NULL};
-    
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|i:fwmkeys", kwlist,
-        &pbuf, &psiz, &max))
+    if (PyBuffer_FillInfo(&view, (PyObject *) self, (void *) buf, siz, 1, PyBUF_SIMPLE))
     {
         return NULL;
     }
+    self->exports++;
     
-    Py_BEGIN_ALLOW_THREADS
-    list = tcbdbfwmkeys(self->db, pbuf, psiz, max);
-    Py_END_ALLOW_THREADS
+    mview = PyMemoryView_FromBuffer(&view);
+    if (!mview)
+    {
+        PyBuffer_Release(&view);
+    }
+    return mview;
+}
+
+
+static bool
+sortedtable_maycontain(SortedTable *self, const char *kbuf, int ksiz)
+{
+    uint64_t hash, h1, h2, bit;
+    int i;
     
-    if (!list)
+    if (!self->bloom)
     {
-        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memort for TCLIST object");
-        return NULL;
+        return true;
     }
     
-    n = tclistnum(list);
-    pylist = PyList_New(n);
-    if (pylist)
+    hash = btree_sshash(kbuf, ksiz);
+    h1 = hash & 0xffffffff;
+    h2 = (hash >> 32) | 1;
+    for (i=0; i<self->bloomk; i++)
     {
-        for (i=0; i<n; i++)
+        bit = (h1 + i * h2) % self->bloombits;
+        if (!(self->bloom[bit / 8] & (1 << (bit % 8))))
         {
-            int vsiz;
-            const char *vbuf;
-            PyObject *value;
-            
-            vbuf = tclistval(list, i, &vsiz);
-            value = PyString_FromStringAndSize(vbuf, vsiz);
-            PyList_SET_ITEM(pylist, i, value);
+            return false;
         }
     }
-    tclistdel(list);
-    
-    return pylist;
+    return true;
 }
 
 
-static PyObject *
-BTree_addint(BTree *self, PyObject *args)
+/* The last block whose first key is <= key, or -1 if key sorts before all. */
+static int
+sortedtable_findblock(SortedTable *self, const char *kbuf, int ksiz)
 {
-    char *kbuf;
-    int ksiz, num, result;
+    int lo = 0, hi = (int) self->nblocks - 1, mid, found = -1;
     
-    if (!PyArg_ParseTuple(args, "s#i:addint", &kbuf, &ksiz, &num))
+    while (lo <= hi)
     {
-        return NULL;
+        mid = lo + (hi - lo) / 2;
+        if (tccmplexical((const char *) self->bkeys[mid], self->bksizs[mid], kbuf, ksiz, NULL) <= 0)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
     }
-    
-    Py_BEGIN_ALLOW_THREADS
-    result = tcbdbaddint(self->db, kbuf, ksiz, num);
-    Py_END_ALLOW_THREADS
-    
-    return PyInt_FromLong((long) result);
+    return found;
 }
 
 
-static PyObject *
-BTree_adddouble(BTree *self, PyObject *args)
+/* Position within a table, with the key of the current entry rebuilt in kbuf. */
+typedef struct
 {
+    uint32_t block;
+    const unsigned char *pos;
+    const unsigned char *end;
+    uint32_t left;
     char *kbuf;
     int ksiz;
-    double num, result;
+    int kcap;
+    const unsigned char *vbuf;
+    int vsiz;
+} SortedTablePos;
+
+
+static void
+sortedtable_seekblock(SortedTable *self, SortedTablePos *sp, uint32_t block)
+{
+    sp->block = block;
+    sp->ksiz = 0;
+    if (block < self->nblocks)
+    {
+        sp->pos = self->bdata[block];
+        sp->end = sp->pos + self->bsizs[block];
+        sp->left = self->bcounts[block];
+    }
+    else
+    {
+        sp->pos = sp->end = NULL;
+        sp->left = 0;
+    }
+}
+
+
+/* Decode the next entry. Returns 1 on success, 0 at the end and -1 on corruption. */
+static int
+sortedtable_next(SortedTable *self, SortedTablePos *sp)
+{
+    uint64_t shared, unshared, vsiz;
     
-    if (!PyArg_ParseTuple(args, "s#d:adddouble", &kbuf, &ksiz, &num))
+    while (!sp->left)
     {
-        return NULL;
+        if (sp->block >= self->nblocks || sp->block + 1 >= self->nblocks)
+        {
+            sp->block = self->nblocks;
+            return 0;
+        }
+        sortedtable_seekblock(self, sp, sp->block + 1);
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    result = tcbdbadddouble(self->db, kbuf, ksiz, num);
-    Py_END_ALLOW_THREADS
+    if (!btree_readvarint(&sp->pos, sp->end, &shared) ||
+        !btree_readvarint(&sp->pos, sp->end, &unshared) ||
+        !btree_readvarint(&sp->pos, sp->end, &vsiz) ||
+        shared > (uint64_t) sp->ksiz || unshared > (uint64_t) (sp->end - sp->pos) ||
+        vsiz > (uint64_t) (sp->end - sp->pos) - unshared || shared + unshared > INT_MAX)
+    {
+        return -1;
+    }
     
-    return PyFloat_FromDouble(result);
+    if ((int) (shared + unshared) > sp->kcap)
+    {
+        char *grown;
+        int cap = (int) (shared + unshared) * 2 + 16;
+        
+        grown = (char *) realloc(sp->kbuf, cap);
+        if (!grown)
+        {
+            return -1;
+        }
+        sp->kbuf = grown;
+        sp->kcap = cap;
+    }
+    
+    memcpy(sp->kbuf + shared, sp->pos, unshared);
+    sp->ksiz = (int) (shared + unshared);
+    sp->pos += unshared;
+    sp->vbuf = sp->pos;
+    sp->vsiz = (int) vsiz;
+    sp->pos += vsiz;
+    sp->left--;
+    return 1;
 }
 
 
-static PyObject *
-BTree_sync(BTree *self)
+/*
+ * Position sp on the first entry >= key (> key if !inc). Returns 1 if there
+ * is one, 0 if not and -1 on corruption.
+ */
+static int
+sortedtable_seek(SortedTable *self, SortedTablePos *sp, const char *kbuf, int ksiz, bool inc)
 {
-    bool success;
+    int block = kbuf ? sortedtable_findblock(self, kbuf, ksiz) : -1;
+    int rv, cmp;
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbsync(self->db);
-    Py_END_ALLOW_THREADS
+    sortedtable_seekblock(self, sp, block < 0 ? 0 : (uint32_t) block);
     
-    if (!success)
+    while ((rv = sortedtable_next(self, sp)) == 1)
     {
-        raise_btree_error(self->db);
-        return NULL;
+        if (!kbuf)
+        {
+            return 1;
+        }
+        cmp = tccmplexical(sp->kbuf, sp->ksiz, kbuf, ksiz, NULL);
+        if (cmp > 0 || (cmp == 0 && inc))
+        {
+            return 1;
+        }
     }
-    
-    Py_RETURN_NONE;
+    return rv;
+}
+
+
+typedef struct
+{
+    PyObject_HEAD
+    SortedTable *table;
+    SortedTablePos sp;
+    bool started;
+    bool done;
+    char *skbuf;
+    int sksiz;
+    bool sinc;
+    char *ekbuf;
+    int eksiz;
+    bool einc;
+} SortedTableIter;
+
+
+static void
+SortedTableIter_dealloc(SortedTableIter *self)
+{
+    Py_XDECREF((PyObject *) self->table);
+    free(self->sp.kbuf);
+    free(self->skbuf);
+    free(self->ekbuf);
+    self->ob_type->tp_free(self);
 }
 
 
 static PyObject *
-BTree_optimize(BTree *self, PyObject *args, PyObject *kwargs)
+SortedTableIter_iternext(SortedTableIter *self)
 {
-    bool success = 0;
-    int lmemb, nmemb;
-    lmemb = nmemb = 0;
-    PY_LONG_LONG bnum = 0;
-    short apow, bpow;
-    apow = bpow = -1;
-    unsigned char opts = UCHAR_MAX;
-    
-    static char *kwlist[] = {"lmemb", "nmemb", "bnum", "apow", "bpow", "opts", NULL };
+    SortedTable *table = self->table;
+    PyObject *value;
+    int rv, cmp;
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iiLhhB:tune", kwlist, 
-        &lmemb, &nmemb, &bnum, &apow, &bpow, &opts))
+    if (self->done)
     {
         return NULL;
     }
     
-    if (apow < SCHAR_MIN || apow > SCHAR_MAX ||
-        bpow < SCHAR_MIN || bpow > SCHAR_MAX)
+    if (!table->map)
     {
+        PyErr_SetString(BTreeError, "The sorted table is closed.");
         return NULL;
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdboptimize(self->db, lmemb, nmemb, bnum, apow, bpow, opts);
-    Py_END_ALLOW_THREADS
+    if (!self->started)
+    {
+        self->started = true;
+        rv = sortedtable_seek(table, &self->sp, self->skbuf, self->sksiz, self->sinc);
+    }
+    else
+    {
+        rv = sortedtable_next(table, &self->sp);
+    }
     
-    if (!success)
+    if (rv < 0)
     {
-        raise_btree_error(self->db);
-        return NULL;
+        self->done = true;
+        return sortedtable_corrupt(table);
     }
-    Py_RETURN_NONE;
-}
-
-
-static PyObject *
-BTree_vanish(BTree *self)
-{
-    bool success;
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbvanish(self->db);
-    Py_END_ALLOW_THREADS
+    if (rv > 0 && self->ekbuf)
+    {
+        cmp = tccmplexical(self->sp.kbuf, self->sp.ksiz, self->ekbuf, self->eksiz, NULL);
+        rv = cmp < 0 || (cmp == 0 && self->einc);
+    }
     
-    if (!success)
+    if (!rv)
     {
-        raise_btree_error(self->db);
+        self->done = true;
         return NULL;
     }
     
-    Py_RETURN_NONE;
+    value = sortedtable_view(table, self->sp.vbuf, self->sp.vsiz);
+    if (!value)
+    {
+        return NULL;
+    }
+    return Py_BuildValue("(s#N)", self->sp.kbuf, self->sp.ksiz, value);
 }
 
 
+static PyTypeObject SortedTableIterType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                                           /* ob_size */
+  "tokyocabinet.btree.SortedTableIter",        /* tp_name */
+  sizeof(SortedTableIter),                     /* tp_basicsize */
+  0,                                           /* tp_itemsize */
+  (destructor)SortedTableIter_dealloc,         /* tp_dealloc */
+  0,                                           /* tp_print */
+  0,                                           /* tp_getattr */
+  0,                                           /* tp_setattr */
+  0,                                           /* tp_compare */
+  0,                                           /* tp_repr */
+  0,                                           /* tp_as_number */
+  0,                                           /* tp_as_sequence */
+  0,                                           /* tp_as_mapping */
+  0,                                           /* tp_hash  */
+  0,                                           /* tp_call */
+  0,                                           /* tp_str */
+  0,                                           /* tp_getattro */
+  0,                                           /* tp_setattro */
+  0,                                           /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                          /* tp_flags */
+  "Iterator over a range of a SortedTable",    /* tp_doc */
+  0,                                           /* tp_traverse */
+  0,                                           /* tp_clear */
+  0,                                           /* tp_richcompare */
+  0,                                           /* tp_weaklistoffset */
+  PyObject_SelfIter,                           /* tp_iter */
+  (iternextfunc)SortedTableIter_iternext,      /* tp_iternext */
+  0,                                           /* tp_methods */
+};
+
+
 static PyObject *
-BTree_copy(BTree *self, PyObject *args)
+sortedtable_iternew(SortedTable *table, PyObject *start, PyObject *stop, int sinc, int einc)
 {
-    bool success;
-    char *path;
+    SortedTableIter *self;
     
-    if (!PyArg_ParseTuple(args, "s", &path))
+    if (!table->map)
     {
+        PyErr_SetString(BTreeError, "The sorted table is closed.");
         return NULL;
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbcopy(self->db, path);
-    Py_END_ALLOW_THREADS
-    
-    if (!success)
+    self = PyObject_New(SortedTableIter, &SortedTableIterType);
+    if (!self)
     {
-        raise_btree_error(self->db);
         return NULL;
     }
     
-    Py_RETURN_NONE;
-}
-
-
-static PyObject *
-BTree_tranbegin(BTree *self)
-{
-    bool success;
-    
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbtranbegin(self->db);
-    Py_END_ALLOW_THREADS
+    Py_INCREF(table);
+    self->table = table;
+    memset(&self->sp, 0, sizeof(self->sp));
+    self->started = self->done = false;
+    self->sinc = sinc != 0;
+    self->einc = einc != 0;
+    self->skbuf = self->ekbuf = NULL;
     
-    if (!success)
+    if (btree_parsebound(start, &self->skbuf, &self->sksiz) ||
+        btree_parsebound(stop, &self->ekbuf, &self->eksiz))
     {
-        raise_btree_error(self->db);
+        Py_DECREF(self);
         return NULL;
     }
     
-    Py_RETURN_NONE;
+    return (PyObject *) self;
 }
 
 
 static PyObject *
-BTree_trancommit(BTree *self)
+SortedTable_get(SortedTable *self, PyObject *args, PyObject *kwargs)
 {
-    bool success;
+    char *kbuf;
+    int ksiz, rv;
+    PyObject *default_value = Py_None, *value;
+    SortedTablePos sp;
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbtrancommit(self->db);
-    Py_END_ALLOW_THREADS
+    static char *kwlist[] = {"key", "default", NULL};
     
-    if (!success)
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|O:get", kwlist,
+        &kbuf, &ksiz, &default_value))
     {
-        raise_btree_error(self->db);
         return NULL;
     }
     
-    Py_RETURN_NONE;
+    if (!self->map)
+    {
+        PyErr_SetString(BTreeError, "The sorted table is closed.");
+        return NULL;
+    }
+    
+    if (!sortedtable_maycontain(self, kbuf, ksiz))
+    {
+        Py_INCREF(default_value);
+        return default_value;
+    }
+    
+    memset(&sp, 0, sizeof(sp));
+    rv = sortedtable_seek(self, &sp, kbuf, ksiz, true);
+    if (rv < 0)
+    {
+        free(sp.kbuf);
+        return sortedtable_corrupt(self);
+    }
+    
+    if (rv && sp.ksiz == ksiz && !memcmp(sp.kbuf, kbuf, ksiz))
+    {
+        value = sortedtable_view(self, sp.vbuf, sp.vsiz);
+    }
+    else
+    {
+        Py_INCREF(default_value);
+        value = default_value;
+    }
+    free(sp.kbuf);
+    return value;
 }
 
 
 static PyObject *
-BTree_tranabort(BTree *self)
+SortedTable_range(SortedTable *self, PyObject *args, PyObject *kwargs)
 {
-    bool success;
+    PyObject *start = Py_None, *stop = Py_None;
+    int sinc = 1, einc = 0;
     
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbtranabort(self->db);
-    Py_END_ALLOW_THREADS
+    static char *kwlist[] = {"start", "stop", "inclusive", NULL};
     
-    if (!success)
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OO(ii):range", kwlist,
+        &start, &stop, &sinc, &einc))
     {
-        raise_btree_error(self->db);
         return NULL;
     }
     
-    Py_RETURN_NONE;
+    return sortedtable_iternew(self, start, stop, sinc, einc);
 }
 
 
 static PyObject *
-BTree_path(BTree *self)
+SortedTable_prefix(SortedTable *self, PyObject *args)
 {
-    const char *path;
+    char *pbuf;
+    int psiz;
+    PyObject *start, *stop, *iter;
     
-    Py_BEGIN_ALLOW_THREADS
-    path = tcbdbpath(self->db);
-    Py_END_ALLOW_THREADS
+    if (!PyArg_ParseTuple(args, "s#:prefix", &pbuf, &psiz))
+    {
+        return NULL;
+    }
     
-    if (!path)
+    /* The first key after every key with the prefix: drop trailing 0xff bytes, bump the last. */
+    while (psiz > 0 && (unsigned char) pbuf[psiz - 1] == 0xff)
     {
-        Py_RETURN_NONE;
+        psiz--;
     }
     
-    return PyString_FromString(path);
+    start = PyTuple_GET_ITEM(args, 0);
+    if (psiz > 0)
+    {
+        stop = PyString_FromStringAndSize(pbuf, psiz);
+        if (!stop)
+        {
+            return NULL;
+        }
+        PyString_AS_STRING(stop)[psiz - 1]++;
+    }
+    else
+    {
+        Py_INCREF(Py_None);
+        stop = Py_None;
+    }
+    
+    iter = sortedtable_iternew(self, start, stop, 1, 0);
+    Py_DECREF(stop);
+    return iter;
 }
 
 
 static PyObject *
-BTree_rnum(BTree *self)
+SortedTable_close(SortedTable *self)
 {
-    uint64_t rnum;
-    
-    Py_BEGIN_ALLOW_THREADS
-    rnum = tcbdbrnum(self->db);
-    Py_END_ALLOW_THREADS
-    
-    return PyLong_FromLongLong(rnum);
+    if (self->exports > 0)
+    {
+        PyErr_SetString(PyExc_BufferError, "Values returned by the sorted table are still in use.");
+        return NULL;
+    }
+    SortedTable_unmap(self);
+    Py_RETURN_NONE;
 }
 
 
 static PyObject *
-BTree_fsiz(BTree *self)
+SortedTable_reduce(SortedTable *self)
 {
-    uint64_t fsiz;
-    
-    Py_BEGIN_ALLOW_THREADS
-    fsiz = tcbdbfsiz(self->db);
-    Py_END_ALLOW_THREADS
-    
-    return PyLong_FromLongLong(fsiz);
+    return Py_BuildValue("(O(s))", (PyObject *) self->ob_type, self->path);
 }
 
 
 static PyObject *
-BTree_cursor(BTree *self)
+SortedTable_iter(SortedTable *self)
 {
-    PyObject *pycur;
-    PyObject *args;
-    
-    args = Py_BuildValue("(O)", self);
-    pycur = BTreeCursor_new(&BTreeCursorType, args, NULL);
-    Py_DECREF(args);
-    
-    if (!pycur)
-    {
-        raise_btree_error(self->db);
-        return NULL;
-    }
-    
-    return pycur;
+    return sortedtable_iternew(self, NULL, NULL, 1, 0);
 }
 
 
-static int
-BTree_length(BTree *self)
+static Py_ssize_t
+SortedTable_length(SortedTable *self)
 {
-    uint64_t rnum;
-    
-    Py_BEGIN_ALLOW_THREADS
-    rnum = tcbdbrnum(self->db);
-    Py_END_ALLOW_THREADS
-    
-    return (int) rnum;
+    return (Py_ssize_t) self->rnum;
 }
 
 
 static PyObject *
-BTree_subscript(BTree *self, PyObject *key)
+SortedTable_subscript(SortedTable *self, PyObject *key)
 {
-    char *kbuf, *vbuf;
-    Py_ssize_t ksiz;
-    Py_ssize_t vsiz;
-    PyObject *value;
-    int tcvsiz;
-    
-    if (!PyString_Check(key))
-    {
-        PyErr_SetString(PyExc_ValueError, "Expected key to be a string.");
-        return NULL;
-    }
-    
-    PyString_AsStringAndSize(key, &kbuf, &ksiz);
+    PyObject *args, *value;
     
-    if (!kbuf)
-    {
-        return NULL;
-    }
-    
-    Py_BEGIN_ALLOW_THREADS
-    vbuf = tcbdbget(self->db, kbuf, (int) ksiz, &tcvsiz);
-    Py_END_ALLOW_THREADS
-    vsiz = tcvsiz;
-
-    if (!vbuf)
+    args = PyTuple_Pack(2, key, Py_None);
+    if (!args)
     {
-        raise_btree_error(self->db);
         return NULL;
     }
+    value = SortedTable_get(self, args, NULL);
+    Py_DECREF(args);
     
-    value = PyString_FromStringAndSize(vbuf, vsiz);
-    free(vbuf);
-    
-    if (!value)
+    if (value == Py_None)
     {
+        Py_DECREF(value);
+        PyErr_SetObject(PyExc_KeyError, key);
         return NULL;
     }
-    
     return value;
 }
 
 
 static int
-BTree_ass_subscript(BTree *self, PyObject *key, PyObject *value)
+SortedTable_contains(SortedTable *self, PyObject *key)
 {
-    bool success;
-    char *kbuf, *vbuf;
-    Py_ssize_t ksiz, vsiz;
-    
-    if (!PyString_Check(key))
-    {
-        PyErr_SetString(PyExc_ValueError, "Expected key to be a string.");
-        return -1;
-    }
-    
-    if (!PyString_Check(value))
-    {
-        PyErr_SetString(PyExc_ValueError, "Expected value to be a string.");
-        return -1;
-    }
-    
-    PyString_AsStringAndSize(key, &kbuf, &ksiz);
-    if (!kbuf)
-    {
-        return -1;
-    }
+    PyObject *value = SortedTable_subscript(self, key);
     
-    PyString_AsStringAndSize(value, &vbuf, &vsiz);
-    if (!vbuf)
+    if (value)
     {
-        return -1;
+        Py_DECREF(value);
+        return 1;
     }
-    
-    Py_BEGIN_ALLOW_THREADS
-    success = tcbdbput(self->db, kbuf, (int) ksiz, vbuf, (int) vsiz);
-    Py_END_ALLOW_THREADS
-    
-    if (!success)
+    if (PyErr_ExceptionMatches(PyExc_KeyError))
     {
-        raise_btree_error(self->db);
-        return -1;
+        PyErr_Clear();
+        return 0;
     }
-    
-    return 0;
+    return -1;
 }
 
 
-static PyMappingMethods BTree_as_mapping = 
+static PyMappingMethods SortedTable_as_mapping = 
 {
-#if PY_VERSION_HEX < 0x02050000
-    (inquiry) BTree_length,
-#else
-    (lenfunc) BTree_length,
-#endif
-    (binaryfunc) BTree_subscript,
-    (objobjargproc) BTree_ass_subscript
+    (lenfunc) SortedTable_length,
+    (binaryfunc) SortedTable_subscript,
+    0
 };
 
 
-static int
-BTree_contains(BTree *self, PyObject *value)
+static PySequenceMethods SortedTable_as_sequence = 
 {
-    char *kbuf;
-    Py_ssize_t ksiz;
-    Py_ssize_t vsiz;
+    0,                                  /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    (objobjproc) SortedTable_contains,  /* sq_contains */
+};
+
+
+static PyBufferProcs SortedTable_as_buffer = 
+{
+    0,                                  /* bf_getreadbuffer */
+    0,                                  /* bf_getwritebuffer */
+    0,                                  /* bf_getsegcount */
+    0,                                  /* bf_getcharbuffer */
+    (getbufferproc) SortedTable_getbuffer,
+    (releasebufferproc) SortedTable_releasebuffer,
+};
+
+
+static PyMethodDef SortedTable_methods[] = 
+{
+    {
+        "get", (PyCFunction) SortedTable_get,
+        METH_VARARGS | METH_KEYWORDS,
+        "Get a memoryview of the value for key, or default if there is none."
+    },
     
-    if (!PyString_Check(value))
     {
-        PyErr_SetString(PyExc_ValueError, "Expected value to be a string");
-        return -1;
-    }
+        "range", (PyCFunction) SortedTable_range,
+        METH_VARARGS | METH_KEYWORDS,
+        "Iterate over the (key, memoryview) pairs in the given range."
+    },
     
-    PyString_AsStringAndSize(value, &kbuf, &ksiz);
-    if (!kbuf)
     {
-        return -1;
-    }
+        "prefix", (PyCFunction) SortedTable_prefix,
+        METH_VARARGS,
+        "Iterate over the (key, memoryview) pairs whose keys start with prefix."
+    },
     
-    Py_BEGIN_ALLOW_THREADS
-    vsiz = tcbdbvsiz(self->db, kbuf, (int) ksiz);
-    Py_END_ALLOW_THREADS
+    {
+        "close", (PyCFunction) SortedTable_close,
+        METH_NOARGS,
+        "Unmap the file. Fails while values returned from it are still alive."
+    },
     
-    return vsiz != -1;
-}
+    {
+        "__reduce__", (PyCFunction) SortedTable_reduce,
+        METH_NOARGS,
+        "Pickle the table as its path."
+    },
+    
+    { NULL }
+};
 
 
-static PySequenceMethods BTree_as_sequence = 
-{
-    0,                             /* sq_length */
-    0,                             /* sq_concat */
-    0,                             /* sq_repeat */
-    0,                             /* sq_item */
-    0,                             /* sq_slice */
-    0,                             /* sq_ass_item */
-    0,                             /* sq_ass_slice */
-    (objobjproc) BTree_contains,   /* sq_contains */
-    0,                             /* sq_inplace_concat */
-    0                              /* sq_inplace_repeat */
+static PyTypeObject SortedTableType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                                           /* ob_size */
+  "tokyocabinet.btree.SortedTable",            /* tp_name */
+  sizeof(SortedTable),                         /* tp_basicsize */
+  0,                                           /* tp_itemsize */
+  (destructor)SortedTable_dealloc,             /* tp_dealloc */
+  0,                                           /* tp_print */
+  0,                                           /* tp_getattr */
+  0,                                           /* tp_setattr */
+  0,                                           /* tp_compare */
+  0,                                           /* tp_repr */
+  0,                                           /* tp_as_number */
+  &SortedTable_as_sequence,                    /* tp_as_sequence */
+  &SortedTable_as_mapping,                     /* tp_as_mapping */
+  0,                                           /* tp_hash  */
+  0,                                           /* tp_call */
+  0,                                           /* tp_str */
+  0,                                           /* tp_getattro */
+  0,                                           /* tp_setattro */
+  &SortedTable_as_buffer,                      /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER, /* tp_flags */
+  "Read-only memory-mapped table exported from a BTree", /* tp_doc */
+  0,                                           /* tp_traverse */
+  0,                                           /* tp_clear */
+  0,                                           /* tp_richcompare */
+  0,                                           /* tp_weaklistoffset */
+  (getiterfunc)SortedTable_iter,               /* tp_iter */
+  0,                                           /* tp_iternext */
+  SortedTable_methods,                         /* tp_methods */
+  0,                                           /* tp_members */
+  0,                                           /* tp_getset */
+  0,                                           /* tp_base */
+  0,                                           /* tp_dict */
+  0,                                           /* tp_descr_get */
+  0,                                           /* tp_descr_set */
+  0,                                           /* tp_dictoffset */
+  0,                                           /* tp_init */
+  0,                                           /* tp_alloc */
+  SortedTable_new,                             /* tp_new */
 };
 
 
@@ -1567,7 +6273,7 @@ static PyMethodDef BTree_methods[] =
     {
         "setcmpfunc", (PyCFunction) BTree_setcmpfunc,
         METH_VARARGS | METH_KEYWORDS,
-        "Set the key comparison function."
+        "Set the key comparison function: a Python callable, a builtin CMP* constant or name, or a list of composite fields."
     },
     
     {
@@ -1577,15 +6283,33 @@ static PyMethodDef BTree_methods[] =
     },
     
     {
-        "setcache", (PyCFunction) BTree_setcache,
+        "setcache", (PyCFunction) BTree_setcache,
+        METH_VARARGS | METH_KEYWORDS,
+        "Set cache parameters."
+    },
+    
+    {
+        "setxmsize", (PyCFunction) BTree_setxmsize,
+        METH_VARARGS | METH_KEYWORDS,
+        "Set size of extra mapped memory."
+    },
+    
+    {
+        "setcachestats", (PyCFunction) BTree_setcachestats,
+        METH_VARARGS,
+        "Start (or stop) counting leaf and node cache loads and evictions."
+    },
+    
+    {
+        "setcachebudget", (PyCFunction) BTree_setcachebudget,
         METH_VARARGS | METH_KEYWORDS,
-        "Set cache parameters."
+        "Resize the leaf and node caches to fit a memory budget in bytes, adapting to their miss rates. Works on an open database."
     },
     
     {
-        "setxmsize", (PyCFunction) BTree_setxmsize,
+        "cachestats", (PyCFunction) BTree_cachestats,
         METH_VARARGS | METH_KEYWORDS,
-        "Set size of extra mapped memory."
+        "Get a dict of cache counters, optionally resetting them."
     },
     
     {
@@ -1624,6 +6348,24 @@ static PyMethodDef BTree_methods[] =
         "Store a record. If a corresponding record exists, insert a new one after it."
     },
     
+    {
+        "putdups", (PyCFunction) BTree_putdups,
+        METH_VARARGS,
+        "Store several values under one key, after any existing ones."
+    },
+    
+    {
+        "putdupmany", (PyCFunction) BTree_putdupmany,
+        METH_VARARGS,
+        "Store each (key, values) pair as with putdups, releasing the GIL once."
+    },
+    
+    {
+        "bulkload", (PyCFunction) BTree_bulkload,
+        METH_VARARGS | METH_KEYWORDS,
+        "Append (key, value) tuples given in ascending key order, optionally into a new file tuned for them (an existing file only with truncate). Repeated keys overwrite unless dup is true."
+    },
+    
     {
         "out", (PyCFunction) BTree_out,
         METH_VARARGS,
@@ -1636,18 +6378,36 @@ static PyMethodDef BTree_methods[] =
         "Remove a record. If there are duplicates all of them are removed."
     },
     
+    {
+        "out_range", (PyCFunction) BTree_out_range,
+        METH_VARARGS | METH_KEYWORDS,
+        "Remove the records in the given range and return how many were removed."
+    },
+    
     {
         "get", (PyCFunction) BTree_get,
         METH_VARARGS | METH_KEYWORDS,
         "Retrieve a record. If none is found None or the supplied default value is returned."
     },
     
+    {
+        "getmany", (PyCFunction) BTree_getmany,
+        METH_VARARGS | METH_KEYWORDS,
+        "Retrieve the values of several keys, in the order given, visiting them in key order."
+    },
+    
     {
         "getdup", (PyCFunction) BTree_getdup,
         METH_VARARGS,
         "Retrieve a list of records with the same key."
     },
     
+    {
+        "idup", (PyCFunction) BTree_idup,
+        METH_VARARGS | METH_KEYWORDS,
+        "Iterate lazily over the values stored under key, reading them in batches."
+    },
+    
     {
         "vnum", (PyCFunction) BTree_vnum,
         METH_VARARGS,
@@ -1666,12 +6426,48 @@ static PyMethodDef BTree_methods[] =
         "Get a list of keys in the given range."
     },
     
+    {
+        "range_items", (PyCFunction) BTree_range_items,
+        METH_VARARGS | METH_KEYWORDS,
+        "Get a list of (key, value) tuples in the given range."
+    },
+    
     {
         "fwmkeys", (PyCFunction) BTree_fwmkeys,
         METH_VARARGS | METH_KEYWORDS,
         "Get a list of of keys that match the given prefix."
     },
     
+    {
+        "irange", (PyCFunction) BTree_irange,
+        METH_VARARGS | METH_KEYWORDS,
+        "Iterate lazily over the records in the given range, reading them in batches."
+    },
+    
+    {
+        "count_range", (PyCFunction) BTree_count_range,
+        METH_VARARGS | METH_KEYWORDS,
+        "Count the records in the given range."
+    },
+    
+    {
+        "estimate_range", (PyCFunction) BTree_estimate_range,
+        METH_VARARGS | METH_KEYWORDS,
+        "Estimate the number of records in the given range without visiting all of them."
+    },
+    
+    {
+        "aggregate", (PyCFunction) BTree_aggregate,
+        METH_VARARGS | METH_KEYWORDS,
+        "Compute count, sum, min, max or avg over the values in the given range, optionally grouped by key prefix."
+    },
+    
+    {
+        "export_sorted", (PyCFunction) BTree_export_sorted,
+        METH_VARARGS | METH_KEYWORDS,
+        "Write every record to an immutable sorted table file for SortedTable."
+    },
+    
     {
         "addint", (PyCFunction) BTree_addint,
         METH_VARARGS,
@@ -1750,6 +6546,18 @@ static PyMethodDef BTree_methods[] =
         "Get a cursor for the database."
     },
     
+    {
+        "__reduce__", (PyCFunction) BTree_reduce,
+        METH_NOARGS,
+        "Pickle the handle as its path, open mode and comparison function."
+    },
+    
+    {
+        "__setstate__", (PyCFunction) BTree_setstate,
+        METH_O,
+        "Reopen a pickled handle."
+    },
+    
     { NULL }
 };
 
@@ -1772,7 +6580,7 @@ static PyTypeObject BTreeType = {
   BTree_Hash,                                  /* tp_hash  */
   0,                                           /* tp_call */
   0,                                           /* tp_str */
-  0,                                           /* tp_getattro */
+  (getattrofunc)BTree_getattro,                /* tp_getattro */
   0,                                           /* tp_setattro */
   0,                                           /* tp_as_buffer */
   Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,    /* tp_flags */
@@ -1799,6 +6607,343 @@ static PyTypeObject BTreeType = {
 
 #define ADD_INT_CONSTANT(module, CONSTANT) PyModule_AddIntConstant(module, #CONSTANT, CONSTANT)
 
+#define BTREE_MERGEAND 0
+#define BTREE_MERGEOR 1
+#define BTREE_MERGEDIFF 2
+
+
+static const char *BTree_merge_names[] = {"and", "or", "diff", NULL};
+
+
+/*
+ * Walks two databases in step and yields the intersection, union or
+ * difference of their key sets, each key once. Both databases have to order
+ * keys the same way.
+ */
+typedef struct
+{
+    PyObject_HEAD
+    BTree *a;
+    BTree *b;
+    BTreeWalk wa;
+    BTreeWalk wb;
+    bool havea;
+    bool haveb;
+    bool started;
+    int op;
+    int batch;
+    TCXSTR *last;
+    TCLIST *keys;
+    int pos;
+    int num;
+    unsigned long forkgen;
+    bool busy;
+} BTreeMerge;
+
+
+static void
+BTreeMerge_dealloc(BTreeMerge *self)
+{
+    btree_walkfree(&self->wa);
+    btree_walkfree(&self->wb);
+    if (self->last)
+    {
+        tcxstrdel(self->last);
+    }
+    if (self->keys)
+    {
+        tclistdel(self->keys);
+    }
+    Py_XDECREF((PyObject *) self->a);
+    Py_XDECREF((PyObject *) self->b);
+    self->ob_type->tp_free(self);
+}
+
+
+/* Move past every duplicate of the current key. */
+static bool
+btree_walknextkey(BTreeWalk *walk, TCXSTR *last)
+{
+    tcxstrclear(last);
+    tcxstrcat(last, tcxstrptr(walk->kxstr), tcxstrsize(walk->kxstr));
+    
+    while (btree_walknext(walk, false))
+    {
+        if (btree_walkcmp(walk, tcxstrptr(last), tcxstrsize(last)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+static bool
+BTreeMerge_fill(BTreeMerge *self)
+{
+    int n = 0, rv;
+    bool emit, probea, probeb;
+    BTreeWalk *wa = &self->wa, *wb = &self->wb;
+    
+    tclistclear(self->keys);
+    
+    probea = btree_probebegin(self->a);
+    probeb = btree_probebegin(self->b);
+    Py_BEGIN_ALLOW_THREADS
+    if (!self->started)
+    {
+        self->started = true;
+        self->havea = btree_walknext(wa, false);
+        self->haveb = btree_walknext(wb, false);
+    }
+    
+    while (n < self->batch && (self->havea || self->haveb))
+    {
+        if (self->op == BTREE_MERGEAND && !(self->havea && self->haveb))
+        {
+            break;
+        }
+        if (self->op == BTREE_MERGEDIFF && !self->havea)
+        {
+            break;
+        }
+        
+        if (self->havea && self->haveb)
+        {
+            rv = btree_walkcmp(wa, tcxstrptr(wb->kxstr), tcxstrsize(wb->kxstr));
+        }
+        else
+        {
+            rv = self->havea ? -1 : 1;
+        }
+        
+        if (rv < 0)
+        {
+            emit = self->op != BTREE_MERGEAND;
+            if (emit)
+            {
+                tclistpush(self->keys, tcxstrptr(wa->kxstr), tcxstrsize(wa->kxstr));
+            }
+            self->havea = btree_walknextkey(wa, self->last);
+        }
+        else if (rv > 0)
+        {
+            emit = self->op == BTREE_MERGEOR;
+            if (emit)
+            {
+                tclistpush(self->keys, tcxstrptr(wb->kxstr), tcxstrsize(wb->kxstr));
+            }
+            self->haveb = btree_walknextkey(wb, self->last);
+        }
+        else
+        {
+            emit = self->op != BTREE_MERGEDIFF;
+            if (emit)
+            {
+                tclistpush(self->keys, tcxstrptr(wa->kxstr), tcxstrsize(wa->kxstr));
+            }
+            self->havea = btree_walknextkey(wa, self->last);
+            self->haveb = btree_walknextkey(wb, self->last);
+        }
+        
+        if (emit)
+        {
+            n++;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    btree_probewalk(self->a, probea, wa);
+    btree_probewalk(self->b, probeb, wb);
+    
+    self->pos = 0;
+    self->num = n;
+    return n > 0;
+}
+
+
+static PyObject *
+BTreeMerge_iternext(BTreeMerge *self)
+{
+    int ksiz;
+    const char *kbuf;
+    
+    if (self->forkgen != btree_forkgen)
+    {
+        PyErr_SetString(BTreeError,
+            "Iterator was created before fork(). Create a new one in this process.");
+        return NULL;
+    }
+    
+    /* Another thread is filling a batch with the GIL released. */
+    if (self->busy)
+    {
+        PyErr_SetString(PyExc_ValueError, "iterator already executing");
+        return NULL;
+    }
+    
+    if (self->pos >= self->num)
+    {
+        bool more;
+        
+        self->busy = true;
+        more = BTreeMerge_fill(self);
+        self->busy = false;
+        if (!more)
+        {
+            return NULL;
+        }
+    }
+    
+    kbuf = tclistval(self->keys, self->pos++, &ksiz);
+    return PyString_FromStringAndSize(kbuf, ksiz);
+}
+
+
+static PyTypeObject BTreeMergeType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                                           /* ob_size */
+  "tokyocabinet.btree.BTreeMerge",             /* tp_name */
+  sizeof(BTreeMerge),                          /* tp_basicsize */
+  0,                                           /* tp_itemsize */
+  (destructor)BTreeMerge_dealloc,              /* tp_dealloc */
+  0,                                           /* tp_print */
+  0,                                           /* tp_getattr */
+  0,                                           /* tp_setattr */
+  0,                                           /* tp_compare */
+  0,                                           /* tp_repr */
+  0,                                           /* tp_as_number */
+  0,                                           /* tp_as_sequence */
+  0,                                           /* tp_as_mapping */
+  0,                                           /* tp_hash  */
+  0,                                           /* tp_call */
+  0,                                           /* tp_str */
+  0,                                           /* tp_getattro */
+  0,                                           /* tp_setattro */
+  0,                                           /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                          /* tp_flags */
+  "Merge of the key sets of two BTree databases", /* tp_doc */
+  0,                                           /* tp_traverse */
+  0,                                           /* tp_clear */
+  0,                                           /* tp_richcompare */
+  0,                                           /* tp_weaklistoffset */
+  PyObject_SelfIter,                           /* tp_iter */
+  (iternextfunc)BTreeMerge_iternext,           /* tp_iternext */
+  0,                                           /* tp_methods */
+};
+
+
+/* Whether two handles order keys the same way. */
+static int
+btree_samecmp(BTree *a, BTree *b)
+{
+    if (tcbdbcmpfunc(a->db) != tcbdbcmpfunc(b->db))
+    {
+        return 0;
+    }
+    if (a->builtin < 0 || b->builtin < 0)
+    {
+        return a->cmp == b->cmp && a->cmpop == b->cmpop;
+    }
+    if (!a->cmpspec && !b->cmpspec)
+    {
+        return 1;
+    }
+    if (!a->cmpspec || !b->cmpspec || a->cmpspec->delim != b->cmpspec->delim)
+    {
+        return 0;
+    }
+    return PyObject_RichCompareBool(a->cmpfields, b->cmpfields, Py_EQ);
+}
+
+
+static PyObject *
+btree_merge(PyObject *module, PyObject *args, PyObject *kwargs)
+{
+    BTree *a, *b;
+    PyObject *opobj = NULL, *start = Py_None, *stop = Py_None;
+    BTreeMerge *self;
+    int op = BTREE_MERGEAND, batch = 100, same;
+    
+    static char *kwlist[] = {"a", "b", "op", "start", "stop", "batch", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O!O!|OOOi:merge", kwlist,
+        &BTreeType, &a, &BTreeType, &b, &opobj, &start, &stop, &batch))
+    {
+        return NULL;
+    }
+    
+    if (opobj && (op = btree_namelookup(BTree_merge_names, opobj, "merge operation")) < 0)
+    {
+        return NULL;
+    }
+    
+    if (batch < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected batch to be at least 1.");
+        return NULL;
+    }
+    
+    if (BTree_checkfork(a) || BTree_checkfork(b) || (same = btree_samecmp(a, b)) < 0)
+    {
+        return NULL;
+    }
+    
+    if (!same)
+    {
+        PyErr_SetString(PyExc_ValueError, "Both databases must use the same comparison function.");
+        return NULL;
+    }
+    
+    self = PyObject_New(BTreeMerge, &BTreeMergeType);
+    if (!self)
+    {
+        return NULL;
+    }
+    
+    Py_INCREF(a);
+    Py_INCREF(b);
+    self->a = a;
+    self->b = b;
+    self->op = op;
+    self->batch = batch;
+    self->havea = self->haveb = self->started = self->busy = false;
+    self->pos = self->num = 0;
+    self->forkgen = btree_forkgen;
+    self->last = tcxstrnew();
+    self->keys = tclistnew();
+    memset(&self->wa, 0, sizeof(self->wa));
+    memset(&self->wb, 0, sizeof(self->wb));
+    
+    if (btree_walkinit(&self->wa, a, start, stop, 1, 0, false) ||
+        btree_walkinit(&self->wb, b, start, stop, 1, 0, false))
+    {
+        Py_DECREF(self);
+        return NULL;
+    }
+    
+    if (!self->last || !self->keys)
+    {
+        Py_DECREF(self);
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate merge buffers");
+        return NULL;
+    }
+    
+    return (PyObject *) self;
+}
+
+
+static PyMethodDef btree_module_methods[] = 
+{
+    {
+        "merge", (PyCFunction) btree_merge,
+        METH_VARARGS | METH_KEYWORDS,
+        "Iterate over the keys in both ('and'), either ('or') or only the first ('diff') of two BTree databases."
+    },
+    
+    { NULL }
+};
+
+
 #ifndef PyMODINIT_FUNC
 #define PyMODINIT_FUNC void
 #endif
@@ -1808,7 +6953,7 @@ initbtree(void)
     PyObject *m;
     
     m = Py_InitModule3(
-            "tokyocabinet.btree", NULL, 
+            "tokyocabinet.btree", btree_module_methods, 
             "Tokyo cabinet BTree database wrapper"
     );
     
@@ -1831,6 +6976,28 @@ initbtree(void)
         return;
     }
     
+    if (PyType_Ready(&BTreeRangeIterType) < 0)
+    {
+        return;
+    }
+    
+    if (PyType_Ready(&BTreeMergeType) < 0)
+    {
+        return;
+    }
+    
+    if (PyType_Ready(&SortedTableType) < 0)
+    {
+        return;
+    }
+    
+    if (PyType_Ready(&SortedTableIterType) < 0)
+    {
+        return;
+    }
+    
+    pthread_atfork(NULL, NULL, btree_atfork_child);
+    
     
     Py_INCREF(&BTreeType);
     PyModule_AddObject(m, "BTree", (PyObject *) &BTreeType);
@@ -1838,6 +7005,9 @@ initbtree(void)
     Py_INCREF(&BTreeCursorType);
     PyModule_AddObject(m, "BTreeCursor", (PyObject *) &BTreeCursorType);
     
+    Py_INCREF(&SortedTableType);
+    PyModule_AddObject(m, "SortedTable", (PyObject *) &SortedTableType);
+    
     ADD_INT_CONSTANT(m, BDBOREADER);
     ADD_INT_CONSTANT(m, BDBOWRITER);
     ADD_INT_CONSTANT(m, BDBOCREAT);
@@ -1855,6 +7025,13 @@ initbtree(void)
     PyModule_AddIntConstant(m, "CMPDECIMAL", 2);
     PyModule_AddIntConstant(m, "CMPINT32", 3);
     PyModule_AddIntConstant(m, "CMPINT64", 4);
+    PyModule_AddIntConstant(m, "CMPREVLEXICAL", 5);
+    PyModule_AddIntConstant(m, "CMPCASELEXICAL", 6);
+    PyModule_AddIntConstant(m, "CMPLENGTH", 7);
+    PyModule_AddIntConstant(m, "CMPINT64BE", 8);
+    PyModule_AddIntConstant(m, "CMPINT64LE", 9);
+    PyModule_AddIntConstant(m, "CMPDOUBLEBE", 10);
+    PyModule_AddIntConstant(m, "CMPDOUBLELE", 11);
     
     ADD_INT_CONSTANT(m, BDBCPCURRENT);
     ADD_INT_CONSTANT(m, BDBCPBEFORE);
@@ -2,11 +2,27 @@
 #include <tchdb.h>
 #include <tcutil.h>
 #include <limits.h>
+#include <pthread.h>
 
 
 static PyObject *HashError;
 
 
+/*
+ * Bumped in the child after every fork(). A handle opened under an older
+ * generation is replaced by a fresh read-only handle the first time the child
+ * uses it.
+ */
+static volatile unsigned long hash_forkgen = 0;
+
+
+static void
+hash_atfork_child(void)
+{
+    hash_forkgen++;
+}
+
+
 static void
 raise_hash_error(TCHDB *db)
 {
@@ -31,6 +47,12 @@ typedef struct
 {
     PyObject_HEAD
     TCHDB *db;
+    bool mutex;
+    int rcnum;
+    PY_LONG_LONG xmsiz;
+    char *path;
+    int omode;
+    unsigned long forkgen;
 } Hash;
 
 
@@ -45,16 +67,114 @@ Hash_Hash(PyObject *self)
 static void
 Hash_dealloc(Hash *self)
 {
-    if (self->db)
+    /* A handle inherited across fork() is left alone, see Hash_reopen. */
+    if (self->db && self->forkgen == hash_forkgen)
     {
         Py_BEGIN_ALLOW_THREADS
         tchdbdel(self->db);
         Py_END_ALLOW_THREADS
     }
+    free(self->path);
     self->ob_type->tp_free(self);
 }
 
 
+static void
+Hash_setopened(Hash *self, const char *path, int omode)
+{
+    free(self->path);
+    self->path = path ? strdup(path) : NULL;
+    self->omode = path ? omode : 0;
+}
+
+
+/*
+ * Replace a handle inherited from the parent process with a new read-only
+ * handle on the same file. The inherited TCHDB is leaked on purpose: closing
+ * it would sync and unlock on the parent's behalf.
+ */
+static bool
+Hash_reopen(Hash *self)
+{
+    bool success;
+    int omode;
+    TCHDB *db;
+    
+    self->forkgen = hash_forkgen;
+    
+    db = tchdbnew();
+    if (!db)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate TCHDB instance.");
+        return false;
+    }
+    
+    if (self->mutex)
+    {
+        tchdbsetmutex(db);
+    }
+    if (self->rcnum)
+    {
+        tchdbsetcache(db, self->rcnum);
+    }
+    if (self->xmsiz)
+    {
+        tchdbsetxmsiz(db, self->xmsiz);
+    }
+    self->db = db;
+    
+    if (!self->path)
+    {
+        return true;
+    }
+    
+    /*
+     * Never wait for the lock: a writer in the parent holds it for as long as
+     * its handle is open, and the child would block on its first access.
+     */
+    omode = HDBOREADER | HDBOLCKNB | (self->omode & HDBONOLCK);
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tchdbopen(db, self->path, omode);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        PyErr_Format(HashError,
+            "Could not reopen %s read-only after fork(): %s. Writer handles cannot "
+            "be used across fork(); open the database again in this process.",
+            self->path, tchdberrmsg(tchdbecode(db)));
+        Hash_setopened(self, NULL, 0);
+        return false;
+    }
+    
+    self->omode = omode;
+    return true;
+}
+
+
+static int
+Hash_checkfork(Hash *self)
+{
+    if (self->forkgen != hash_forkgen && !Hash_reopen(self))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+static PyObject *
+Hash_getattro(Hash *self, PyObject *name)
+{
+    if (Hash_checkfork(self))
+    {
+        return NULL;
+    }
+    return PyObject_GenericGetAttr((PyObject *) self, name);
+}
+
+
 static PyObject *
 Hash_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 {
@@ -67,6 +187,8 @@ Hash_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         return NULL;
     }
     
+    self->forkgen = hash_forkgen;
+    
     self->db = tchdbnew();
     if (!self->db)
     {
@@ -88,6 +210,7 @@ Hash_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
             Py_END_ALLOW_THREADS
             if (success)
             {
+                Hash_setopened(self, path, omode);
                 return (PyObject *) self;
             }
             raise_hash_error(self->db);
@@ -115,6 +238,7 @@ Hash_setmutex(Hash *self)
         raise_hash_error(self->db);
         return NULL;
     }
+    self->mutex = true;
     Py_RETURN_NONE;
 }
 
@@ -178,6 +302,7 @@ Hash_setcache(Hash *self, PyObject *args, PyObject *kwargs)
         raise_hash_error(self->db);
         return NULL;
     }
+    self->rcnum = rcnum;
     Py_RETURN_NONE;
 }
 
@@ -202,6 +327,7 @@ Hash_setxmsize(Hash *self, PyObject *args)
         raise_hash_error(self->db);
         return NULL;
     }
+    self->xmsiz = xmsiz;
     Py_RETURN_NONE;
 }
 
@@ -221,6 +347,7 @@ Hash_open(Hash *self, PyObject *args, PyObject *kwargs)
         Py_END_ALLOW_THREADS
         if (success)
         {
+            Hash_setopened(self, path, omode);
             Py_RETURN_NONE;
         }
         raise_hash_error(self->db);
@@ -241,6 +368,7 @@ Hash_close(Hash *self)
         raise_hash_error(self->db);
         return NULL;
     }
+    Hash_setopened(self, NULL, 0);
     Py_RETURN_NONE;
 }
 
@@ -691,11 +819,28 @@ Hash_fsiz(Hash *self)
 }
 
 
+static PyObject *
+Hash_reduce(Hash *self)
+{
+    if (!self->path)
+    {
+        return Py_BuildValue("(O())", (PyObject *) self->ob_type);
+    }
+    return Py_BuildValue("(O(si))", (PyObject *) self->ob_type,
+        self->path, (self->omode & ~(HDBOWRITER | HDBOCREAT | HDBOTRUNC)) | HDBOREADER);
+}
+
+
 static int
 Hash_length(Hash *self)
 {
     uint64_t rnum;
     
+    if (Hash_checkfork(self))
+    {
+        return -1;
+    }
+    
     Py_BEGIN_ALLOW_THREADS
     rnum = tchdbrnum(self->db);
     Py_END_ALLOW_THREADS
@@ -713,6 +858,11 @@ Hash_subscript(Hash *self, PyObject *key)
     PyObject *value;
     int tcvsiz;
     
+    if (Hash_checkfork(self))
+    {
+        return NULL;
+    }
+    
     if (!PyString_Check(key))
     {
         PyErr_SetString(PyExc_ValueError, "Expected key to be a string.");
@@ -756,6 +906,11 @@ Hash_ass_subscript(Hash *self, PyObject *key, PyObject *value)
     char *kbuf, *vbuf;
     Py_ssize_t ksiz, vsiz;
     
+    if (Hash_checkfork(self))
+    {
+        return -1;
+    }
+    
     if (!PyString_Check(key))
     {
         PyErr_SetString(PyExc_ValueError, "Expected key to be a string.");
@@ -813,6 +968,11 @@ Hash_contains(Hash *self, PyObject *value)
     Py_ssize_t ksiz;
     Py_ssize_t vsiz;
     
+    if (Hash_checkfork(self))
+    {
+        return -1;
+    }
+    
     if (!PyString_Check(value))
     {
         PyErr_SetString(PyExc_ValueError, "Expected value to be a string");
@@ -1000,6 +1160,12 @@ static PyMethodDef Hash_methods[] =
         "Get the size of the database in bytes."
     },
     
+    {
+        "__reduce__", (PyCFunction) Hash_reduce,
+        METH_NOARGS,
+        "Pickle the handle as its path and open mode."
+    },
+    
     { NULL }
 };
 
@@ -1022,7 +1188,7 @@ static PyTypeObject HashType = {
   Hash_Hash,                                  /* tp_hash  */
   0,                                           /* tp_call */
   0,                                           /* tp_str */
-  0,                                           /* tp_getattro */
+  (getattrofunc)Hash_getattro,                 /* tp_getattro */
   0,                                           /* tp_setattro */
   0,                                           /* tp_as_buffer */
   Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,    /* tp_flags */
@@ -1076,6 +1242,8 @@ inithash(void)
         return;
     }
     
+    pthread_atfork(NULL, NULL, hash_atfork_child);
+    
     
     Py_INCREF(&HashType);
     PyModule_AddObject(m, "Hash", (PyObject *) &HashType);
@@ -0,0 +1,448 @@
+#include <Python.h>
+#include <stdint.h>
+#include <string.h>
+
+
+/*
+ * Order-preserving encoding of tuples into byte strings. Packed keys compare
+ * bytewise (the default BTree comparator) in the same order as the tuples
+ * they came from compare element by element.
+ *
+ * Every element starts with a type code, so values of different types order
+ * by type: None < str < unicode < int < float.
+ *
+ *   None     0x00
+ *   str      0x01, bytes with 0x00 escaped as 0x00 0xff, then 0x00
+ *   unicode  0x02, UTF-8 escaped the same way, then 0x00
+ *   int      0x15, 8-byte big-endian with the sign bit flipped
+ *   float    0x21, 8-byte big-endian IEEE 754 with the sign bit flipped for
+ *            positive numbers and all bits flipped for negative ones
+ *
+ * No type code is 0xff, so every key starting with pack(prefix) sorts below
+ * pack(prefix) + '\xff'.
+ */
+
+#define KC_NONE 0x00
+#define KC_BYTES 0x01
+#define KC_UNICODE 0x02
+#define KC_INT 0x15
+#define KC_FLOAT 0x21
+#define KC_ESCAPE 0xff
+
+
+static PyObject *KeyCodecError;
+
+
+typedef struct
+{
+    char *buf;
+    Py_ssize_t size;
+    Py_ssize_t asize;
+} KeyBuffer;
+
+
+static int
+keybuf_reserve(KeyBuffer *kb, Py_ssize_t n)
+{
+    char *buf;
+    Py_ssize_t asize;
+    
+    if (kb->size + n <= kb->asize)
+    {
+        return 0;
+    }
+    
+    asize = kb->asize * 2;
+    if (asize < kb->size + n)
+    {
+        asize = kb->size + n;
+    }
+    
+    buf = (char *) realloc(kb->buf, asize);
+    if (!buf)
+    {
+        PyErr_NoMemory();
+        return -1;
+    }
+    
+    kb->buf = buf;
+    kb->asize = asize;
+    return 0;
+}
+
+
+static int
+keybuf_putc(KeyBuffer *kb, unsigned char c)
+{
+    if (keybuf_reserve(kb, 1))
+    {
+        return -1;
+    }
+    kb->buf[kb->size++] = (char) c;
+    return 0;
+}
+
+
+static int
+keybuf_putu64(KeyBuffer *kb, unsigned char code, uint64_t num)
+{
+    int i;
+    
+    if (keybuf_reserve(kb, 9))
+    {
+        return -1;
+    }
+    kb->buf[kb->size++] = (char) code;
+    for (i = 7; i >= 0; i--)
+    {
+        kb->buf[kb->size++] = (char) ((num >> (i * 8)) & 0xff);
+    }
+    return 0;
+}
+
+
+static int
+keybuf_putstr(KeyBuffer *kb, unsigned char code, const char *str, Py_ssize_t len)
+{
+    Py_ssize_t i;
+    
+    /* Worst case every byte is escaped. */
+    if (keybuf_reserve(kb, len * 2 + 2))
+    {
+        return -1;
+    }
+    kb->buf[kb->size++] = (char) code;
+    for (i = 0; i < len; i++)
+    {
+        kb->buf[kb->size++] = str[i];
+        if (!str[i])
+        {
+            kb->buf[kb->size++] = (char) KC_ESCAPE;
+        }
+    }
+    kb->buf[kb->size++] = 0;
+    return 0;
+}
+
+
+static int
+keycodec_packitem(KeyBuffer *kb, PyObject *item)
+{
+    PY_LONG_LONG num;
+    double dnum;
+    uint64_t bits;
+    PyObject *utf8;
+    int rv;
+    
+    if (item == Py_None)
+    {
+        return keybuf_putc(kb, KC_NONE);
+    }
+    
+    if (PyString_Check(item))
+    {
+        return keybuf_putstr(kb, KC_BYTES, PyString_AS_STRING(item), PyString_GET_SIZE(item));
+    }
+    
+    if (PyUnicode_Check(item))
+    {
+        utf8 = PyUnicode_AsUTF8String(item);
+        if (!utf8)
+        {
+            return -1;
+        }
+        rv = keybuf_putstr(kb, KC_UNICODE, PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8));
+        Py_DECREF(utf8);
+        return rv;
+    }
+    
+    if (PyInt_Check(item) || PyLong_Check(item))
+    {
+        num = PyLong_AsLongLong(item);
+        if (num == -1 && PyErr_Occurred())
+        {
+            return -1;
+        }
+        return keybuf_putu64(kb, KC_INT, (uint64_t) num ^ 0x8000000000000000ULL);
+    }
+    
+    if (PyFloat_Check(item))
+    {
+        dnum = PyFloat_AS_DOUBLE(item);
+        memcpy(&bits, &dnum, sizeof(bits));
+        bits = (bits & 0x8000000000000000ULL) ? ~bits : bits | 0x8000000000000000ULL;
+        return keybuf_putu64(kb, KC_FLOAT, bits);
+    }
+    
+    PyErr_Format(PyExc_TypeError, "Cannot pack values of type %.200s.",
+        item->ob_type->tp_name);
+    return -1;
+}
+
+
+static PyObject *
+keycodec_packtuple(PyObject *tuple, const char *suffix, Py_ssize_t suffixlen)
+{
+    Py_ssize_t i, n;
+    PyObject *result;
+    KeyBuffer kb;
+    
+    if (!PyTuple_Check(tuple))
+    {
+        PyErr_SetString(PyExc_TypeError, "Expected a tuple.");
+        return NULL;
+    }
+    
+    n = PyTuple_GET_SIZE(tuple);
+    kb.size = 0;
+    kb.asize = n * 10 + suffixlen + 1;
+    kb.buf = (char *) malloc(kb.asize);
+    if (!kb.buf)
+    {
+        return PyErr_NoMemory();
+    }
+    
+    for (i = 0; i < n; i++)
+    {
+        if (keycodec_packitem(&kb, PyTuple_GET_ITEM(tuple, i)))
+        {
+            free(kb.buf);
+            return NULL;
+        }
+    }
+    
+    if (suffixlen)
+    {
+        if (keybuf_reserve(&kb, suffixlen))
+        {
+            free(kb.buf);
+            return NULL;
+        }
+        memcpy(kb.buf + kb.size, suffix, suffixlen);
+        kb.size += suffixlen;
+    }
+    
+    result = PyString_FromStringAndSize(kb.buf, kb.size);
+    free(kb.buf);
+    return result;
+}
+
+
+static uint64_t
+keycodec_readu64(const unsigned char *buf)
+{
+    int i;
+    uint64_t num = 0;
+    
+    for (i = 0; i < 8; i++)
+    {
+        num = (num << 8) | buf[i];
+    }
+    return num;
+}
+
+
+/* Decode an escaped, terminated string starting at *pos and advance past it. */
+static PyObject *
+keycodec_unpackstr(const unsigned char *buf, Py_ssize_t size, Py_ssize_t *pos, int unicode)
+{
+    Py_ssize_t i, len = 0;
+    char *out;
+    PyObject *result;
+    
+    out = (char *) malloc(size - *pos + 1);
+    if (!out)
+    {
+        return PyErr_NoMemory();
+    }
+    
+    for (i = *pos; i < size; i++)
+    {
+        if (!buf[i])
+        {
+            if (i + 1 < size && buf[i + 1] == KC_ESCAPE)
+            {
+                out[len++] = 0;
+                i++;
+                continue;
+            }
+            break;
+        }
+        out[len++] = (char) buf[i];
+    }
+    
+    if (i >= size)
+    {
+        free(out);
+        PyErr_SetString(KeyCodecError, "Unterminated string in packed key.");
+        return NULL;
+    }
+    *pos = i + 1;
+    
+    if (unicode)
+    {
+        result = PyUnicode_DecodeUTF8(out, len, "strict");
+    }
+    else
+    {
+        result = PyString_FromStringAndSize(out, len);
+    }
+    free(out);
+    return result;
+}
+
+
+static PyObject *
+keycodec_pack(PyObject *self, PyObject *tuple)
+{
+    return keycodec_packtuple(tuple, NULL, 0);
+}
+
+
+static PyObject *
+keycodec_unpack(PyObject *self, PyObject *args)
+{
+    const char *raw;
+    const unsigned char *buf;
+    int size;
+    Py_ssize_t pos = 0;
+    uint64_t bits;
+    double dnum;
+    PyObject *list, *item, *tuple;
+    
+    if (!PyArg_ParseTuple(args, "s#:unpack", &raw, &size))
+    {
+        return NULL;
+    }
+    buf = (const unsigned char *) raw;
+    
+    list = PyList_New(0);
+    if (!list)
+    {
+        return NULL;
+    }
+    
+    while (pos < size)
+    {
+        switch (buf[pos++])
+        {
+            case KC_NONE:
+                Py_INCREF(Py_None);
+                item = Py_None;
+                break;
+            
+            case KC_BYTES:
+            case KC_UNICODE:
+                item = keycodec_unpackstr(buf, size, &pos, buf[pos - 1] == KC_UNICODE);
+                break;
+            
+            case KC_INT:
+            case KC_FLOAT:
+                if (size - pos < 8)
+                {
+                    PyErr_SetString(KeyCodecError, "Truncated number in packed key.");
+                    item = NULL;
+                    break;
+                }
+                bits = keycodec_readu64(buf + pos);
+                if (buf[pos - 1] == KC_INT)
+                {
+                    item = PyLong_FromLongLong((PY_LONG_LONG) (bits ^ 0x8000000000000000ULL));
+                }
+                else
+                {
+                    bits = (bits & 0x8000000000000000ULL) ? bits & ~0x8000000000000000ULL : ~bits;
+                    memcpy(&dnum, &bits, sizeof(dnum));
+                    item = PyFloat_FromDouble(dnum);
+                }
+                pos += 8;
+                break;
+            
+            default:
+                PyErr_Format(KeyCodecError, "Unknown type code 0x%02x in packed key.", buf[pos - 1]);
+                item = NULL;
+        }
+        
+        if (!item || PyList_Append(list, item))
+        {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    
+    tuple = PyList_AsTuple(list);
+    Py_DECREF(list);
+    return tuple;
+}
+
+
+static PyObject *
+keycodec_prefix_range(PyObject *self, PyObject *tuple)
+{
+    PyObject *start, *stop;
+    
+    start = keycodec_packtuple(tuple, NULL, 0);
+    if (!start)
+    {
+        return NULL;
+    }
+    
+    stop = keycodec_packtuple(tuple, "\xff", 1);
+    if (!stop)
+    {
+        Py_DECREF(start);
+        return NULL;
+    }
+    
+    return Py_BuildValue("(NN)", start, stop);
+}
+
+
+static PyMethodDef keycodec_methods[] = 
+{
+    {
+        "pack", (PyCFunction) keycodec_pack,
+        METH_O,
+        "Pack a tuple of None, str, unicode, int and float values into an order-preserving key."
+    },
+    
+    {
+        "unpack", (PyCFunction) keycodec_unpack,
+        METH_VARARGS,
+        "Unpack a key made by pack() back into a tuple."
+    },
+    
+    {
+        "prefix_range", (PyCFunction) keycodec_prefix_range,
+        METH_O,
+        "Get the (start, stop) keys bounding every key whose tuple starts with the given prefix. start is inclusive, stop exclusive."
+    },
+    
+    { NULL }
+};
+
+
+#ifndef PyMODINIT_FUNC
+#define PyMODINIT_FUNC void
+#endif
+PyMODINIT_FUNC
+initkeycodec(void)
+{
+    PyObject *m;
+    
+    m = Py_InitModule3(
+            "tokyocabinet.keycodec", keycodec_methods, 
+            "Order-preserving tuple key encoding for BTree composite keys"
+    );
+    
+    if (!m)
+    {
+        return;
+    }
+    
+    KeyCodecError = PyErr_NewException("tokyocabinet.keycodec.error", NULL, NULL);
+    Py_INCREF(KeyCodecError);
+    PyModule_AddObject(m, "error", KeyCodecError);
+}
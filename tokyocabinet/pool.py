@@ -0,0 +1,173 @@
+"""Pools of read-only handles on a single database file.
+
+A handle created with ``setmutex()`` serializes every thread on Tokyo
+Cabinet's internal locks, and a B+ tree handle additionally serializes
+readers on its page cache. ``ReaderPool`` side-steps both by opening several
+independent read-only handles on the same file and binding each thread to
+one of them for as long as the thread is alive.
+"""
+
+import threading
+import weakref
+import Queue
+
+from tokyocabinet import btree
+
+
+class PoolTimeout(Exception):
+    """No handle became free within the pool's timeout."""
+
+
+# Put in the free queue by close() to wake the threads waiting for a handle.
+_CLOSED = object()
+
+
+class _Lease(object):
+    """Ties a handle to the lifetime of the thread holding it.
+
+    The lease lives only in the pool's thread-local storage, so it is
+    collected when its thread exits and the weakref callback hands the
+    handle back to the pool.
+    """
+    __slots__ = ('db', '__weakref__')
+
+    def __init__(self, db):
+        self.db = db
+
+
+class ReaderPool(object):
+    """A fixed number of read-only handles on one database file.
+
+    ``dbtype`` is the handle class to instantiate (``btree.BTree`` by
+    default, ``hash.Hash`` works the same way). ``setup`` is called with each
+    handle before it is opened and is the place for ``setcmpfunc``,
+    ``setcache`` or ``setxmsize``, which all have to happen before ``open``.
+
+    The pool never opens the file for writing; keep a separate writer handle
+    for that. Readers see what the writer has synced to the file.
+
+    A thread takes a handle on its first read and keeps it until it exits or
+    calls ``release()``. When all handles are taken, new threads block for up
+    to ``timeout`` seconds (forever if ``None``) and then raise
+    ``PoolTimeout``.
+    """
+
+    def __init__(self, path, size=4, dbtype=btree.BTree, omode=btree.BDBOREADER,
+                 setup=None, timeout=None):
+        if size < 1:
+            raise ValueError("Expected size to be at least 1.")
+
+        self.path = path
+        self.size = size
+        self.timeout = timeout
+        self.closed = False
+
+        self._local = threading.local()
+        self._free = Queue.Queue()
+        self._handles = []
+        self._leases = set()
+        self._lock = threading.Lock()
+
+        try:
+            for i in xrange(size):
+                db = dbtype()
+                if setup is not None:
+                    setup(db)
+                db.open(path, omode)
+                self._handles.append(db)
+                self._free.put(db)
+        except:
+            self.close()
+            raise
+
+    def _return(self, ref, db):
+        with self._lock:
+            self._leases.discard(ref)
+            if self.closed:
+                return
+        self._free.put(db)
+
+    def handle(self):
+        """Get the handle bound to the calling thread, taking one if needed."""
+        if self.closed:
+            raise ValueError("The pool is closed.")
+
+        lease = getattr(self._local, 'lease', None)
+        if lease is not None:
+            return lease.db
+
+        try:
+            db = self._free.get(True, self.timeout)
+        except Queue.Empty:
+            raise PoolTimeout("No free handle in %g seconds." % self.timeout)
+        if db is _CLOSED:
+            # Leave it for the next waiter.
+            self._free.put(db)
+            raise ValueError("The pool is closed.")
+
+        lease = _Lease(db)
+        ref = weakref.ref(lease, lambda ref, db=db: self._return(ref, db))
+        with self._lock:
+            self._leases.add(ref)
+        self._local.lease = lease
+        return db
+
+    def release(self):
+        """Give the calling thread's handle back to the pool, if it has one."""
+        self._local.lease = None
+
+    def close(self):
+        """Close every handle in the pool.
+
+        Threads still holding a lease, or waiting for one, get
+        ``ValueError`` rather than a closed handle.
+        """
+        with self._lock:
+            self.closed = True
+            self._leases.clear()
+        self._local = threading.local()
+        while True:
+            try:
+                self._free.get_nowait()
+            except Queue.Empty:
+                break
+        self._free.put(_CLOSED)
+        handles, self._handles = self._handles, []
+        for db in handles:
+            db.close()
+
+    def get(self, key, default=None):
+        return self.handle().get(key, default)
+
+    def getmany(self, keys, default=None):
+        db = self.handle()
+        if hasattr(db, 'getmany'):
+            return db.getmany(keys, default)
+        return [db.get(key, default) for key in keys]
+
+    def getdup(self, key):
+        return self.handle().getdup(key)
+
+    def vnum(self, key):
+        return self.handle().vnum(key)
+
+    def vsiz(self, key):
+        return self.handle().vsiz(key)
+
+    def range(self, *args, **kwargs):
+        return self.handle().range(*args, **kwargs)
+
+    def fwmkeys(self, *args, **kwargs):
+        return self.handle().fwmkeys(*args, **kwargs)
+
+    def rnum(self):
+        return self.handle().rnum()
+
+    def __len__(self):
+        return len(self.handle())
+
+    def __getitem__(self, key):
+        return self.handle()[key]
+
+    def __contains__(self, key):
+        return key in self.handle()
@@ -2,15 +2,23 @@
 #include <tctdb.h>
 #include <tcutil.h>
 #include <limits.h>
+#include <pthread.h>
 
 
+/*
+ * Convert a record in one pass over the map, reading each value through the
+ * iterator instead of looking its column up again. Column names are interned
+ * since the same few recur in every record, and values keep their sizes so
+ * that binary data survives.
+ */
 static PyObject *
 tcmap2pydict(TCMAP *map)
 {
-    const char *kstr, *vstr;
-    PyObject *dict, *value;
+    const char *kbuf, *vbuf;
+    int ksiz, vsiz;
+    PyObject *dict, *key, *value;
     
-    dict = PyDict_New();
+    dict = _PyDict_NewPresized((Py_ssize_t) tcmaprnum(map));
     
     if (dict == NULL)
     {
@@ -19,39 +27,37 @@ tcmap2pydict(TCMAP *map)
     }
     
     tcmapiterinit(map);
-    kstr = tcmapiternext2(map);
     
-    while (kstr != NULL)
+    while ((kbuf = tcmapiternext(map, &ksiz)) != NULL)
     {
-        vstr = tcmapget2(map, kstr);
+        vbuf = tcmapiterval(kbuf, &vsiz);
         
-        if (vstr == NULL)
+        key = PyString_FromStringAndSize(kbuf, ksiz);
+        if (key == NULL)
         {
             Py_DECREF(dict);
-            PyErr_SetString(PyExc_MemoryError, "Could not allocate memory for map value.");
             return NULL;
         }
+        PyString_InternInPlace(&key);
         
-        value = PyString_FromString(vstr);
-        
+        value = PyString_FromStringAndSize(vbuf, vsiz);
         if (value == NULL)
         {
+            Py_DECREF(key);
             Py_DECREF(dict);
-            PyErr_SetString(PyExc_MemoryError, "Could not allocate memory for dict value.");
             return NULL;
         }
         
-        if (PyDict_SetItemString(dict, kstr, value) != 0)
+        if (PyDict_SetItem(dict, key, value) != 0)
         {
+            Py_DECREF(key);
             Py_DECREF(value);
             Py_DECREF(dict);
-            PyErr_SetString(PyExc_Exception, "Could not set dict item.");
             return NULL;
         }
         
+        Py_DECREF(key);
         Py_DECREF(value);
-        
-        kstr = tcmapiternext2(map);
     }
     
     return dict;
@@ -68,11 +74,11 @@ pydict2tcmap(PyObject *dict)
     }
     
     PyObject *key, *value;
-    Py_ssize_t pos = 0;
-    const char *kstr, *vstr;
+    Py_ssize_t pos = 0, ksiz;
+    char *kbuf;
     TCMAP *map;
     
-    map = tcmapnew();
+    map = tcmapnew2(PyDict_Size(dict) + 1);
     
     if (map == NULL)
     {
@@ -89,201 +95,1204 @@ pydict2tcmap(PyObject *dict)
             return NULL;
         }
         
-        kstr = PyString_AsString(key);
-        vstr = PyString_AsString(value);
+        if (PyString_AsStringAndSize(key, &kbuf, &ksiz) != 0)
+        {
+            tcmapdel(map);
+            return NULL;
+        }
         
-        tcmapput2(map, kstr, vstr);
+        tcmapput(map, kbuf, (int) ksiz,
+            PyString_AS_STRING(value), (int) PyString_GET_SIZE(value));
     }
     
     return map;
 }
 
 
-static PyObject *TableError;
+/*
+ * A read-only view of a record that owns its TCMAP and only creates Python
+ * strings for the columns that are read. dict(record) converts all of it.
+ */
+typedef struct
+{
+    PyObject_HEAD
+    TCMAP *map;
+} Record;
 
 
-static void
-raise_table_error(TCTDB *db)
+static PyTypeObject RecordType;
+
+
+static PyObject *
+record_new(TCMAP *map)
 {
-    int code = tctdbecode(db);
-    const char *msg = tctdberrmsg(code);
+    Record *self = PyObject_New(Record, &RecordType);
     
-    if (code == TCENOREC)
-    {
-        PyErr_SetString(PyExc_KeyError, msg);
-    }
-    else
+    if (self == NULL)
     {
-        PyErr_SetString(TableError, msg);
+        tcmapdel(map);
+        return NULL;
     }
+    
+    self->map = map;
+    return (PyObject *) self;
 }
 
 
-static PyTypeObject TableType;
-static PyTypeObject TableQueryType;
+static void
+Record_dealloc(Record *self)
+{
+    tcmapdel(self->map);
+    PyObject_Del(self);
+}
 
-typedef struct
+
+static Py_ssize_t
+Record_length(Record *self)
 {
-    PyObject_HEAD
-    TCTDB *db;
-} Table;
+    return (Py_ssize_t) tcmaprnum(self->map);
+}
 
-typedef struct
+
+/* The value of a column as a new string, or NULL without an exception if it is missing. */
+static PyObject *
+record_lookup(Record *self, PyObject *key, bool *missing)
 {
-    PyObject_HEAD
-    TDBQRY *q;
-} TableQuery;
+    char *kbuf;
+    Py_ssize_t ksiz;
+    const char *vbuf;
+    int vsiz;
+    
+    *missing = false;
+    
+    /* A column name can only be a string, so anything else is just absent. */
+    if (!PyString_Check(key) && !PyUnicode_Check(key))
+    {
+        *missing = true;
+        return NULL;
+    }
+    
+    if (PyString_AsStringAndSize(key, &kbuf, &ksiz) != 0)
+    {
+        return NULL;
+    }
+    
+    vbuf = tcmapget(self->map, kbuf, (int) ksiz, &vsiz);
+    if (vbuf == NULL)
+    {
+        *missing = true;
+        return NULL;
+    }
+    
+    return PyString_FromStringAndSize(vbuf, vsiz);
+}
 
 
+static PyObject *
+Record_subscript(Record *self, PyObject *key)
+{
+    bool missing;
+    PyObject *value = record_lookup(self, key, &missing);
+    
+    if (missing)
+    {
+        PyErr_SetObject(PyExc_KeyError, key);
+    }
+    return value;
+}
 
-static long
-TableQuery_Hash(PyObject *self)
+
+static int
+Record_contains(Record *self, PyObject *key)
 {
-    PyErr_SetString(PyExc_TypeError, "Table query objects are not hashable.");
-    return -1;
+    bool missing;
+    PyObject *value = record_lookup(self, key, &missing);
+    
+    if (value == NULL)
+    {
+        return missing ? 0 : -1;
+    }
+    Py_DECREF(value);
+    return 1;
 }
 
 
-static void
-TableQuery_dealloc(TableQuery *self)
+static PyObject *
+Record_get(Record *self, PyObject *args)
 {
-    if (self->q)
+    PyObject *key, *default_value = Py_None, *value;
+    bool missing;
+    
+    if (!PyArg_ParseTuple(args, "O|O:get", &key, &default_value))
     {
-        Py_BEGIN_ALLOW_THREADS
-        tctdbqrydel(self->q);
-        Py_END_ALLOW_THREADS
+        return NULL;
     }
-    self->ob_type->tp_free(self);
+    
+    value = record_lookup(self, key, &missing);
+    if (missing)
+    {
+        Py_INCREF(default_value);
+        return default_value;
+    }
+    return value;
 }
 
 
+#define RECORD_KEYS 0
+#define RECORD_VALUES 1
+#define RECORD_ITEMS 2
+
+
+/* A list of the keys, values or (key, value) items, in one pass over the map. */
 static PyObject *
-TableQuery_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+record_list(Record *self, int what)
 {
-    TableQuery *self;
-    Table *pydb;
+    const char *kbuf, *vbuf;
+    int ksiz, vsiz;
+    Py_ssize_t i = 0;
+    PyObject *list, *key = NULL, *value = NULL, *item;
     
-    self = (TableQuery *) type->tp_alloc(type, 0);
-    if (!self)
+    list = PyList_New((Py_ssize_t) tcmaprnum(self->map));
+    if (list == NULL)
     {
-        PyErr_SetString(PyExc_MemoryError, "Cannot allocate TableQuery instance.");
         return NULL;
     }
     
-    if (PyArg_ParseTuple(args, "O!", &TableType, &pydb))
+    tcmapiterinit(self->map);
+    while ((kbuf = tcmapiternext(self->map, &ksiz)) != NULL)
     {
-        self->q = tctdbqrynew(pydb->db);
-        if (!self->q)
+        if (what != RECORD_VALUES)
         {
-            raise_table_error(pydb->db);
+            key = PyString_FromStringAndSize(kbuf, ksiz);
+            if (key == NULL)
+            {
+                Py_DECREF(list);
+                return NULL;
+            }
+            PyString_InternInPlace(&key);
+        }
+        
+        if (what != RECORD_KEYS)
+        {
+            vbuf = tcmapiterval(kbuf, &vsiz);
+            value = PyString_FromStringAndSize(vbuf, vsiz);
+            if (value == NULL)
+            {
+                Py_XDECREF(key);
+                Py_DECREF(list);
+                return NULL;
+            }
+        }
+        
+        if (what == RECORD_ITEMS)
+        {
+            item = PyTuple_Pack(2, key, value);
+            Py_DECREF(key);
+            Py_DECREF(value);
+            if (item == NULL)
+            {
+                Py_DECREF(list);
+                return NULL;
+            }
         }
         else
         {
-            return (PyObject *) self;
+            item = what == RECORD_KEYS ? key : value;
         }
+        PyList_SET_ITEM(list, i++, item);
     }
     
-    TableQuery_dealloc(self);
-    return NULL;
+    return list;
 }
 
 
 static PyObject *
-TableQuery_addcond(TableQuery *self, PyObject *args, PyObject *kwargs)
+Record_keys(Record *self)
 {
-    const char *name, *expr;
-    name = expr = NULL;
-    int op = 0;
-    
-    static char *kwlist[] = {"name", "op", "expr", NULL};
+    return record_list(self, RECORD_KEYS);
+}
+
+
+static PyObject *
+Record_values(Record *self)
+{
+    return record_list(self, RECORD_VALUES);
+}
+
+
+static PyObject *
+Record_items(Record *self)
+{
+    return record_list(self, RECORD_ITEMS);
+}
+
+
+static PyObject *
+Record_todict(Record *self)
+{
+    return tcmap2pydict(self->map);
+}
+
+
+static PyObject *
+Record_iter(Record *self)
+{
+    PyObject *keys, *iter;
     
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "si|s:addcond", kwlist, 
-        &name, &op, &expr))
+    keys = record_list(self, RECORD_KEYS);
+    if (keys == NULL)
     {
         return NULL;
     }
-    
-    Py_BEGIN_ALLOW_THREADS
-    tctdbqryaddcond(self->q, name, op, expr);
-    Py_END_ALLOW_THREADS
-    
-    Py_RETURN_NONE;
+    iter = PyObject_GetIter(keys);
+    Py_DECREF(keys);
+    return iter;
 }
 
 
 static PyObject *
-TableQuery_setorder(TableQuery *self, PyObject *args)
+Record_repr(Record *self)
 {
-    const char *name;
-    int type;
+    PyObject *dict, *repr;
     
-    if (!PyArg_ParseTuple(args, "si:setorder", &name, &type))
+    dict = tcmap2pydict(self->map);
+    if (dict == NULL)
     {
         return NULL;
     }
-    
-    Py_BEGIN_ALLOW_THREADS
-    tctdbqrysetorder(self->q, name, type);
-    Py_END_ALLOW_THREADS
-    
-    Py_RETURN_NONE;
+    repr = PyObject_Repr(dict);
+    Py_DECREF(dict);
+    return repr;
 }
 
 
+/* Records compare equal to dicts (and other records) with the same items. */
 static PyObject *
-TableQuery_setlimit(TableQuery *self, PyObject *args)
+Record_richcompare(Record *self, PyObject *other, int op)
 {
-    int max, skip;
-    max = skip = -1;
+    PyObject *dict, *result;
     
-    if (!PyArg_ParseTuple(args, "ii:setlimit", &max, &skip))
+    if ((op != Py_EQ && op != Py_NE) ||
+        !(PyDict_Check(other) || PyObject_TypeCheck(other, &RecordType)))
+    {
+        Py_INCREF(Py_NotImplemented);
+        return Py_NotImplemented;
+    }
+    
+    dict = tcmap2pydict(self->map);
+    if (dict == NULL)
     {
         return NULL;
     }
     
-    Py_BEGIN_ALLOW_THREADS
-    tctdbqrysetlimit(self->q, max, skip);
-    Py_END_ALLOW_THREADS
+    if (PyObject_TypeCheck(other, &RecordType))
+    {
+        other = tcmap2pydict(((Record *) other)->map);
+        if (other == NULL)
+        {
+            Py_DECREF(dict);
+            return NULL;
+        }
+    }
+    else
+    {
+        Py_INCREF(other);
+    }
     
-    Py_RETURN_NONE;
+    result = PyObject_RichCompare(dict, other, op);
+    Py_DECREF(dict);
+    Py_DECREF(other);
+    return result;
+}
+
+
+static PyMappingMethods Record_as_mapping = 
+{
+    (lenfunc) Record_length,
+    (binaryfunc) Record_subscript,
+    0
+};
+
+
+static PySequenceMethods Record_as_sequence = 
+{
+    0,                                  /* sq_length */
+    0,                                  /* sq_concat */
+    0,                                  /* sq_repeat */
+    0,                                  /* sq_item */
+    0,                                  /* sq_slice */
+    0,                                  /* sq_ass_item */
+    0,                                  /* sq_ass_slice */
+    (objobjproc) Record_contains,       /* sq_contains */
+};
+
+
+static PyMethodDef Record_methods[] = 
+{
+    {
+        "get", (PyCFunction) Record_get,
+        METH_VARARGS,
+        "Get the value of a column, or default if the record lacks it."
+    },
+    
+    {
+        "keys", (PyCFunction) Record_keys,
+        METH_NOARGS,
+        "Get a list of the column names."
+    },
+    
+    {
+        "values", (PyCFunction) Record_values,
+        METH_NOARGS,
+        "Get a list of the column values."
+    },
+    
+    {
+        "items", (PyCFunction) Record_items,
+        METH_NOARGS,
+        "Get a list of (column, value) tuples."
+    },
+    
+    {
+        "todict", (PyCFunction) Record_todict,
+        METH_NOARGS,
+        "Convert the whole record to a dict."
+    },
+    
+    { NULL }
+};
+
+
+static PyTypeObject RecordType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                                           /* ob_size */
+  "tokyocabinet.table.Record",                 /* tp_name */
+  sizeof(Record),                              /* tp_basicsize */
+  0,                                           /* tp_itemsize */
+  (destructor)Record_dealloc,                  /* tp_dealloc */
+  0,                                           /* tp_print */
+  0,                                           /* tp_getattr */
+  0,                                           /* tp_setattr */
+  0,                                           /* tp_compare */
+  (reprfunc)Record_repr,                       /* tp_repr */
+  0,                                           /* tp_as_number */
+  &Record_as_sequence,                         /* tp_as_sequence */
+  &Record_as_mapping,                          /* tp_as_mapping */
+  0,                                           /* tp_hash  */
+  0,                                           /* tp_call */
+  0,                                           /* tp_str */
+  0,                                           /* tp_getattro */
+  0,                                           /* tp_setattro */
+  0,                                           /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                          /* tp_flags */
+  "Read-only view of a table record",          /* tp_doc */
+  0,                                           /* tp_traverse */
+  0,                                           /* tp_clear */
+  (richcmpfunc)Record_richcompare,             /* tp_richcompare */
+  0,                                           /* tp_weaklistoffset */
+  (getiterfunc)Record_iter,                    /* tp_iter */
+  0,                                           /* tp_iternext */
+  Record_methods,                              /* tp_methods */
+};
+
+
+static PyObject *TableError;
+
+
+/*
+ * Bumped in the child after every fork(). A handle opened under an older
+ * generation is replaced by a fresh read-only handle the first time the child
+ * uses it.
+ */
+static volatile unsigned long table_forkgen = 0;
+
+
+static void
+table_atfork_child(void)
+{
+    table_forkgen++;
 }
 
 
+static void
+raise_table_error(TCTDB *db)
+{
+    int code = tctdbecode(db);
+    const char *msg = tctdberrmsg(code);
+    
+    if (code == TCENOREC)
+    {
+        PyErr_SetString(PyExc_KeyError, msg);
+    }
+    else
+    {
+        PyErr_SetString(TableError, msg);
+    }
+}
+
+
+static PyTypeObject TableType;
+static PyTypeObject TableQueryType;
+
+typedef struct
+{
+    PyObject_HEAD
+    TCTDB *db;
+    bool mutex;
+    int rcnum, lcnum, ncnum;
+    PY_LONG_LONG xmsiz;
+    char *path;
+    int omode;
+    unsigned long forkgen;
+    bool lazy;
+} Table;
+
+typedef struct
+{
+    PyObject_HEAD
+    TDBQRY *q;
+    Table *pydb;
+    unsigned long forkgen;
+} TableQuery;
+
+
+static int Table_checkfork(Table *self);
+
+
+
+/*
+ * Parse the columns argument of get and getmany into a fast sequence of
+ * strings, or NULL for the whole record. as_tuple needs explicit columns.
+ */
+static int
+table_parsecolumns(PyObject *columns, int as_tuple, PyObject **fast)
+{
+    Py_ssize_t i, n;
+    
+    *fast = NULL;
+    
+    if (columns == NULL || columns == Py_None)
+    {
+        if (as_tuple)
+        {
+            PyErr_SetString(PyExc_ValueError, "as_tuple requires a list of columns.");
+            return -1;
+        }
+        return 0;
+    }
+    
+    *fast = PySequence_Fast(columns, "Expected columns to be a sequence of strings.");
+    if (*fast == NULL)
+    {
+        return -1;
+    }
+    
+    n = PySequence_Fast_GET_SIZE(*fast);
+    for (i=0; i<n; i++)
+    {
+        if (!PyString_Check(PySequence_Fast_GET_ITEM(*fast, i)))
+        {
+            Py_CLEAR(*fast);
+            PyErr_SetString(PyExc_TypeError, "Expected columns to be a sequence of strings.");
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+
+/*
+ * Convert only the named columns of a record: a dict of those present, or a
+ * tuple in column order with None for those missing.
+ */
+static PyObject *
+tcmap2pycols(TCMAP *map, PyObject *fast, bool as_tuple)
+{
+    Py_ssize_t i, n;
+    PyObject *result, *column, *value;
+    const char *vbuf;
+    int vsiz;
+    
+    if (fast == NULL)
+    {
+        return tcmap2pydict(map);
+    }
+    
+    n = PySequence_Fast_GET_SIZE(fast);
+    result = as_tuple ? PyTuple_New(n) : _PyDict_NewPresized(n);
+    if (result == NULL)
+    {
+        return NULL;
+    }
+    
+    for (i=0; i<n; i++)
+    {
+        column = PySequence_Fast_GET_ITEM(fast, i);
+        vbuf = tcmapget(map, PyString_AS_STRING(column), (int) PyString_GET_SIZE(column), &vsiz);
+        
+        if (vbuf == NULL)
+        {
+            if (as_tuple)
+            {
+                Py_INCREF(Py_None);
+                PyTuple_SET_ITEM(result, i, Py_None);
+            }
+            continue;
+        }
+        
+        value = PyString_FromStringAndSize(vbuf, vsiz);
+        if (value == NULL)
+        {
+            Py_DECREF(result);
+            return NULL;
+        }
+        
+        if (as_tuple)
+        {
+            PyTuple_SET_ITEM(result, i, value);
+        }
+        else
+        {
+            if (PyDict_SetItem(result, column, value) != 0)
+            {
+                Py_DECREF(value);
+                Py_DECREF(result);
+                return NULL;
+            }
+            Py_DECREF(value);
+        }
+    }
+    
+    return result;
+}
+
+
+/*
+ * Convert a fetched record and free it, or hand it to a Record when a lazy
+ * read of the whole record was asked for.
+ */
+static PyObject *
+table_convert(TCMAP *map, PyObject *fast, bool as_tuple, bool lazy)
+{
+    PyObject *value;
+    
+    if (lazy && fast == NULL)
+    {
+        return record_new(map);
+    }
+    
+    value = tcmap2pycols(map, fast, as_tuple);
+    tcmapdel(map);
+    return value;
+}
+
+
+/* The lazy argument of a read, defaulting to the handle's setlazy() setting. */
+static int
+table_parselazy(Table *self, PyObject *obj, bool *lazy)
+{
+    int rv;
+    
+    if (obj == NULL || obj == Py_None)
+    {
+        *lazy = self->lazy;
+        return 0;
+    }
+    
+    if ((rv = PyObject_IsTrue(obj)) < 0)
+    {
+        return -1;
+    }
+    *lazy = rv != 0;
+    return 0;
+}
+
+
+static long
+TableQuery_Hash(PyObject *self)
+{
+    PyErr_SetString(PyExc_TypeError, "Table query objects are not hashable.");
+    return -1;
+}
+
+
+static void
+TableQuery_dealloc(TableQuery *self)
+{
+    if (self->q)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        tctdbqrydel(self->q);
+        Py_END_ALLOW_THREADS
+    }
+    Py_XDECREF((PyObject *) self->pydb);
+    self->ob_type->tp_free(self);
+}
+
+
+static PyObject *
+TableQuery_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
+{
+    TableQuery *self;
+    Table *pydb;
+    
+    self = (TableQuery *) type->tp_alloc(type, 0);
+    if (!self)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate TableQuery instance.");
+        return NULL;
+    }
+    
+    if (PyArg_ParseTuple(args, "O!", &TableType, &pydb) && !Table_checkfork(pydb))
+    {
+        self->forkgen = table_forkgen;
+        self->q = tctdbqrynew(pydb->db);
+        if (!self->q)
+        {
+            raise_table_error(pydb->db);
+        }
+        else
+        {
+            Py_INCREF(pydb);
+            self->pydb = pydb;
+            return (PyObject *) self;
+        }
+    }
+    
+    TableQuery_dealloc(self);
+    return NULL;
+}
+
+
+static PyObject *
+TableQuery_getattro(TableQuery *self, PyObject *name)
+{
+    if (self->forkgen != table_forkgen)
+    {
+        PyErr_SetString(TableError,
+            "Query was created before fork(). Create a new one in this process.");
+        return NULL;
+    }
+    return PyObject_GenericGetAttr((PyObject *) self, name);
+}
+
+
+static PyObject *
+TableQuery_addcond(TableQuery *self, PyObject *args, PyObject *kwargs)
+{
+    const char *name, *expr;
+    name = expr = NULL;
+    int op = 0;
+    
+    static char *kwlist[] = {"name", "op", "expr", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "si|s:addcond", kwlist, 
+        &name, &op, &expr))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    tctdbqryaddcond(self->q, name, op, expr);
+    Py_END_ALLOW_THREADS
+    
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+TableQuery_setorder(TableQuery *self, PyObject *args)
+{
+    const char *name;
+    int type;
+    
+    if (!PyArg_ParseTuple(args, "si:setorder", &name, &type))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    tctdbqrysetorder(self->q, name, type);
+    Py_END_ALLOW_THREADS
+    
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+TableQuery_setlimit(TableQuery *self, PyObject *args)
+{
+    int max, skip;
+    max = skip = -1;
+    
+    if (!PyArg_ParseTuple(args, "ii:setlimit", &max, &skip))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    tctdbqrysetlimit(self->q, max, skip);
+    Py_END_ALLOW_THREADS
+    
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+TableQuery_search(TableQuery *self)
+{
+    TCLIST *results;
+    int n = 0, i=0, vsiz = 0;
+    const char *vbuf;
+    PyObject *pylist, *val;
+    
+    Py_BEGIN_ALLOW_THREADS
+    results = tctdbqrysearch(self->q);
+    Py_END_ALLOW_THREADS
+    
+    if (!results)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memory for TCLIST object");
+        return NULL;
+    }
+    
+    n = tclistnum(results);
+    pylist = PyList_New(n);
+    
+    if (pylist)
+    {
+        for (i=0; i<n; i++)
+        {
+            vbuf = tclistval(results, i, &vsiz);
+            val = PyString_FromStringAndSize(vbuf, vsiz);
+            PyList_SET_ITEM(pylist, i, val);
+            
+            vsiz = 0;
+        }
+    }
+    tclistdel(results);
+    
+    return pylist;
+}
+
+
+/*
+ * Run the query and fetch the matching records in the same trip, returning
+ * (key, record) tuples in result order. Records removed since the search
+ * are left out; any other failed fetch is raised.
+ */
+static PyObject *
+TableQuery_search_records(TableQuery *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *columns = NULL, *lazyobj = NULL, *limitobj = Py_None;
+    PyObject *fast, *pylist, *key, *value, *item;
+    Table *pydb = self->pydb;
+    TCLIST *results;
+    TCMAP **recs;
+    Py_ssize_t limit = -1;
+    int as_tuple = 0, n, i, ksiz;
+    const char *kbuf;
+    bool lazy, failed = false;
+    
+    static char *kwlist[] = {"columns", "limit", "as_tuple", "lazy", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OOiO:search_records", kwlist,
+        &columns, &limitobj, &as_tuple, &lazyobj))
+    {
+        return NULL;
+    }
+    
+    if (limitobj != Py_None)
+    {
+        limit = PyInt_AsSsize_t(limitobj);
+        if (limit == -1 && PyErr_Occurred())
+        {
+            return NULL;
+        }
+        if (limit < 0)
+        {
+            PyErr_SetString(PyExc_ValueError, "Expected limit to be None or >= 0.");
+            return NULL;
+        }
+    }
+    
+    if (Table_checkfork(pydb) || table_parselazy(pydb, lazyobj, &lazy) ||
+        table_parsecolumns(columns, as_tuple, &fast))
+    {
+        return NULL;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    results = tctdbqrysearch(self->q);
+    Py_END_ALLOW_THREADS
+    
+    if (!results)
+    {
+        Py_XDECREF(fast);
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memory for TCLIST object");
+        return NULL;
+    }
+    
+    n = tclistnum(results);
+    if (limit >= 0 && limit < n)
+    {
+        n = (int) limit;
+    }
+    
+    recs = (TCMAP **) calloc(n + 1, sizeof(TCMAP *));
+    if (!recs)
+    {
+        tclistdel(results);
+        Py_XDECREF(fast);
+        return PyErr_NoMemory();
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    for (i=0; i<n; i++)
+    {
+        kbuf = tclistval(results, i, &ksiz);
+        recs[i] = tctdbget(pydb->db, kbuf, ksiz);
+        if (!recs[i] && tctdbecode(pydb->db) != TCENOREC)
+        {
+            failed = true;
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    
+    if (failed)
+    {
+        raise_table_error(pydb->db);
+        pylist = NULL;
+    }
+    else
+    {
+        pylist = PyList_New(0);
+    }
+    
+    for (i=0; pylist && i<n; i++)
+    {
+        if (!recs[i])
+        {
+            continue;
+        }
+        
+        kbuf = tclistval(results, i, &ksiz);
+        key = PyString_FromStringAndSize(kbuf, ksiz);
+        value = table_convert(recs[i], fast, as_tuple != 0, lazy);
+        recs[i] = NULL;
+        item = key && value ? PyTuple_Pack(2, key, value) : NULL;
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+        
+        if (!item || PyList_Append(pylist, item))
+        {
+            Py_XDECREF(item);
+            Py_CLEAR(pylist);
+            break;
+        }
+        Py_DECREF(item);
+    }
+    
+    for (i=0; i<n; i++)
+    {
+        if (recs[i])
+        {
+            tcmapdel(recs[i]);
+        }
+    }
+    free(recs);
+    tclistdel(results);
+    Py_XDECREF(fast);
+    
+    return pylist;
+}
+
+
+/*
+ * Iterator over the results of a query. Tokyo Cabinet builds the list of
+ * matching keys in one go (tctdbqryproc does the same internally), so the
+ * search runs on the first next() call and the keys stay in that native
+ * list. Records, when asked for, are fetched batch records at a time with
+ * the GIL released, and nothing past the batch the consumer stopped in is
+ * read.
+ */
+typedef struct
+{
+    PyObject_HEAD
+    TableQuery *query;
+    TCLIST *keys;
+    int pos;
+    int batch;
+    bool records;
+    PyObject *fast;
+    bool as_tuple;
+    bool lazy;
+    TCMAP **recs;
+    int rpos;
+    int rnum;
+    bool busy;
+} TableQueryIter;
+
+
+static void
+tablequeryiter_freerecs(TableQueryIter *self)
+{
+    int i;
+    
+    for (i=self->rpos; i<self->rnum; i++)
+    {
+        if (self->recs[i])
+        {
+            tcmapdel(self->recs[i]);
+        }
+    }
+    self->rpos = self->rnum = 0;
+}
+
+
+static void
+TableQueryIter_dealloc(TableQueryIter *self)
+{
+    if (self->recs)
+    {
+        tablequeryiter_freerecs(self);
+        free(self->recs);
+    }
+    if (self->keys)
+    {
+        tclistdel(self->keys);
+    }
+    Py_XDECREF(self->fast);
+    Py_XDECREF((PyObject *) self->query);
+    self->ob_type->tp_free(self);
+}
+
+
+/*
+ * Fetch the records of the next batch of keys. A missing record was removed
+ * since the search ran; any other failure is raised.
+ */
+static bool
+tablequeryiter_fill(TableQueryIter *self)
+{
+    TCTDB *db = self->query->pydb->db;
+    const char *kbuf;
+    int ksiz, i, n;
+    bool ok = true;
+    
+    n = tclistnum(self->keys) - self->pos;
+    if (n > self->batch)
+    {
+        n = self->batch;
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    for (i=0; i<n; i++)
+    {
+        kbuf = tclistval(self->keys, self->pos + i, &ksiz);
+        self->recs[i] = tctdbget(db, kbuf, ksiz);
+        if (!self->recs[i] && tctdbecode(db) != TCENOREC)
+        {
+            ok = false;
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    
+    self->rpos = 0;
+    self->rnum = i;
+    
+    if (!ok)
+    {
+        tablequeryiter_freerecs(self);
+        raise_table_error(db);
+    }
+    return ok;
+}
+
+
+static PyObject *
+TableQueryIter_iternext(TableQueryIter *self)
+{
+    const char *kbuf;
+    int ksiz;
+    TCMAP *rec;
+    PyObject *key, *value, *item;
+    
+    if (self->query->forkgen != table_forkgen)
+    {
+        PyErr_SetString(TableError,
+            "Query was created before fork(). Create a new one in this process.");
+        return NULL;
+    }
+    
+    /* Another thread is searching or filling a batch with the GIL released. */
+    if (self->busy)
+    {
+        PyErr_SetString(PyExc_ValueError, "iterator already executing");
+        return NULL;
+    }
+    
+    if (!self->keys)
+    {
+        TCLIST *keys;
+        
+        self->busy = true;
+        Py_BEGIN_ALLOW_THREADS
+        keys = tctdbqrysearch(self->query->q);
+        Py_END_ALLOW_THREADS
+        self->busy = false;
+        
+        if (!keys)
+        {
+            PyErr_SetString(PyExc_MemoryError, "Cannot allocate memory for TCLIST object");
+            return NULL;
+        }
+        self->keys = keys;
+    }
+    
+    while (self->pos < tclistnum(self->keys))
+    {
+        if (!self->records)
+        {
+            kbuf = tclistval(self->keys, self->pos++, &ksiz);
+            return PyString_FromStringAndSize(kbuf, ksiz);
+        }
+        
+        if (self->rpos >= self->rnum)
+        {
+            bool ok;
+            
+            self->busy = true;
+            ok = tablequeryiter_fill(self);
+            self->busy = false;
+            if (!ok)
+            {
+                return NULL;
+            }
+        }
+        
+        kbuf = tclistval(self->keys, self->pos++, &ksiz);
+        rec = self->recs[self->rpos];
+        self->recs[self->rpos++] = NULL;
+        
+        /* Removed since the search ran. */
+        if (!rec)
+        {
+            continue;
+        }
+        
+        key = PyString_FromStringAndSize(kbuf, ksiz);
+        value = table_convert(rec, self->fast, self->as_tuple, self->lazy);
+        item = key && value ? PyTuple_Pack(2, key, value) : NULL;
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+        return item;
+    }
+    
+    return NULL;
+}
+
+
+static PyTypeObject TableQueryIterType = {
+  PyObject_HEAD_INIT(NULL)
+  0,                                           /* ob_size */
+  "tokyocabinet.table.TableQueryIter",         /* tp_name */
+  sizeof(TableQueryIter),                      /* tp_basicsize */
+  0,                                           /* tp_itemsize */
+  (destructor)TableQueryIter_dealloc,          /* tp_dealloc */
+  0,                                           /* tp_print */
+  0,                                           /* tp_getattr */
+  0,                                           /* tp_setattr */
+  0,                                           /* tp_compare */
+  0,                                           /* tp_repr */
+  0,                                           /* tp_as_number */
+  0,                                           /* tp_as_sequence */
+  0,                                           /* tp_as_mapping */
+  0,                                           /* tp_hash  */
+  0,                                           /* tp_call */
+  0,                                           /* tp_str */
+  0,                                           /* tp_getattro */
+  0,                                           /* tp_setattro */
+  0,                                           /* tp_as_buffer */
+  Py_TPFLAGS_DEFAULT,                          /* tp_flags */
+  "Iterator over the results of a table query", /* tp_doc */
+  0,                                           /* tp_traverse */
+  0,                                           /* tp_clear */
+  0,                                           /* tp_richcompare */
+  0,                                           /* tp_weaklistoffset */
+  PyObject_SelfIter,                           /* tp_iter */
+  (iternextfunc)TableQueryIter_iternext,       /* tp_iternext */
+  0,                                           /* tp_methods */
+};
+
+
 static PyObject *
-TableQuery_search(TableQuery *self)
+TableQuery_iter(TableQuery *self, PyObject *args, PyObject *kwargs)
 {
-    TCLIST *results;
-    int n = 0, i=0, vsiz = 0;
-    const char *vbuf;
-    PyObject *pylist, *val;
+    PyObject *records = Py_False, *columns = NULL, *lazyobj = NULL;
+    TableQueryIter *iter;
+    int batch = 100, as_tuple = 0, withrecs;
+    bool lazy;
     
-    Py_BEGIN_ALLOW_THREADS
-    results = tctdbqrysearch(self->q);
-    Py_END_ALLOW_THREADS
+    static char *kwlist[] = {"batch", "records", "columns", "as_tuple", "lazy", NULL};
     
-    if (!results)
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iOOiO:iter", kwlist,
+        &batch, &records, &columns, &as_tuple, &lazyobj))
     {
-        PyErr_SetString(PyExc_MemoryError, "Cannot allocate memory for TCLIST object");
         return NULL;
     }
     
-    n = tclistnum(results);
-    pylist = PyList_New(n);
+    if (batch < 1)
+    {
+        PyErr_SetString(PyExc_ValueError, "Expected batch to be at least 1.");
+        return NULL;
+    }
     
-    if (pylist)
+    if ((withrecs = PyObject_IsTrue(records)) < 0 ||
+        table_parselazy(self->pydb, lazyobj, &lazy))
     {
-        for (i=0; i<n; i++)
+        return NULL;
+    }
+    
+    iter = PyObject_New(TableQueryIter, &TableQueryIterType);
+    if (!iter)
+    {
+        return NULL;
+    }
+    
+    Py_INCREF(self);
+    iter->query = self;
+    iter->keys = NULL;
+    iter->pos = 0;
+    iter->batch = batch;
+    iter->as_tuple = as_tuple != 0;
+    iter->lazy = lazy;
+    iter->recs = NULL;
+    iter->rpos = iter->rnum = 0;
+    iter->busy = false;
+    
+    if (table_parsecolumns(columns, as_tuple, &iter->fast))
+    {
+        Py_DECREF(iter);
+        return NULL;
+    }
+    
+    /* Asking for columns implies asking for records. */
+    iter->records = withrecs || iter->fast;
+    if (iter->records)
+    {
+        iter->recs = (TCMAP **) calloc(batch, sizeof(TCMAP *));
+        if (!iter->recs)
         {
-            vbuf = tclistval(results, i, &vsiz);
-            val = PyString_FromStringAndSize(vbuf, vsiz);
-            PyList_SET_ITEM(pylist, i, val);
-            
-            vsiz = 0;
+            Py_DECREF(iter);
+            return PyErr_NoMemory();
         }
     }
-    tclistdel(results);
     
-    return pylist;
+    return (PyObject *) iter;
 }
 
 
@@ -313,25 +1322,35 @@ TableQuery_hint(TableQuery *self)
 }
 
 
+/*
+ * Tokyo Cabinet has no way to count matches without collecting their keys,
+ * but the list is dropped before the GIL is taken back and no Python
+ * objects are created for it.
+ */
 static PyObject *
 TableQuery_count(TableQuery *self)
 {
     TCLIST *results;
-    int n = 0;
+    Py_ssize_t n = 0;
+    bool ok;
     
     Py_BEGIN_ALLOW_THREADS
     results = tctdbqrysearch(self->q);
+    ok = results != NULL;
+    if (ok)
+    {
+        n = tclistnum(results);
+        tclistdel(results);
+    }
     Py_END_ALLOW_THREADS
     
-    if (!results)
+    if (!ok)
     {
         PyErr_SetString(PyExc_MemoryError, "Cannot allocate memory for TCLIST object");
         return NULL;
     }
     
-    n = tclistnum(results);
-    
-    return Py_BuildValue("i", n);
+    return PyInt_FromSsize_t(n);
 }
 
 
@@ -361,6 +1380,18 @@ static PyMethodDef TableQuery_methods[] =
         "Run the query. Returns the keys of matching records"
     },
     
+    {
+        "search_records", (PyCFunction) TableQuery_search_records,
+        METH_VARARGS | METH_KEYWORDS,
+        "Run the query. Returns (key, record) tuples for the matching records"
+    },
+    
+    {
+        "iter", (PyCFunction) TableQuery_iter,
+        METH_VARARGS | METH_KEYWORDS,
+        "Run the query lazily. Yields keys, or (key, record) tuples fetched in batches"
+    },
+    
     {
         "searchout", (PyCFunction) TableQuery_searchout,
         METH_NOARGS,
@@ -401,7 +1432,7 @@ static PyTypeObject TableQueryType = {
   TableQuery_Hash,                             /* tp_hash  */
   0,                                           /* tp_call */
   0,                                           /* tp_str */
-  0,                                           /* tp_getattro */
+  (getattrofunc)TableQuery_getattro,           /* tp_getattro */
   0,                                           /* tp_setattro */
   0,                                           /* tp_as_buffer */
   Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,    /* tp_flags */
@@ -438,20 +1469,121 @@ Table_Hash(PyObject *self)
 static void
 Table_dealloc(Table *self)
 {
-    if (self->db)
+    /* A handle inherited across fork() is left alone, see Table_reopen. */
+    if (self->db && self->forkgen == table_forkgen)
     {
         Py_BEGIN_ALLOW_THREADS
         tctdbdel(self->db);
         Py_END_ALLOW_THREADS
     }
+    free(self->path);
     self->ob_type->tp_free(self);
 }
 
 
+static void
+Table_setopened(Table *self, const char *path, int omode)
+{
+    free(self->path);
+    self->path = path ? strdup(path) : NULL;
+    self->omode = path ? omode : 0;
+}
+
+
+/*
+ * Replace a handle inherited from the parent process with a new read-only
+ * handle on the same file. The inherited TCTDB is leaked on purpose: closing
+ * it would sync and unlock on the parent's behalf.
+ */
+static bool
+Table_reopen(Table *self)
+{
+    bool success;
+    int omode;
+    TCTDB *db;
+    
+    self->forkgen = table_forkgen;
+    
+    db = tctdbnew();
+    if (!db)
+    {
+        PyErr_SetString(PyExc_MemoryError, "Cannot allocate TCTDB instance.");
+        return false;
+    }
+    
+    if (self->mutex)
+    {
+        tctdbsetmutex(db);
+    }
+    if (self->rcnum || self->lcnum || self->ncnum)
+    {
+        tctdbsetcache(db, self->rcnum, self->lcnum, self->ncnum);
+    }
+    if (self->xmsiz)
+    {
+        tctdbsetxmsiz(db, self->xmsiz);
+    }
+    self->db = db;
+    
+    if (!self->path)
+    {
+        return true;
+    }
+    
+    /*
+     * Never wait for the lock: a writer in the parent holds it for as long as
+     * its handle is open, and the child would block on its first access.
+     */
+    omode = TDBOREADER | TDBOLCKNB | (self->omode & TDBONOLCK);
+    
+    Py_BEGIN_ALLOW_THREADS
+    success = tctdbopen(db, self->path, omode);
+    Py_END_ALLOW_THREADS
+    
+    if (!success)
+    {
+        PyErr_Format(TableError,
+            "Could not reopen %s read-only after fork(): %s. Writer handles cannot "
+            "be used across fork(); open the database again in this process.",
+            self->path, tctdberrmsg(tctdbecode(db)));
+        Table_setopened(self, NULL, 0);
+        return false;
+    }
+    
+    self->omode = omode;
+    return true;
+}
+
+
+static int
+Table_checkfork(Table *self)
+{
+    if (self->forkgen != table_forkgen && !Table_reopen(self))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+static PyObject *
+Table_getattro(Table *self, PyObject *name)
+{
+    if (Table_checkfork(self))
+    {
+        return NULL;
+    }
+    return PyObject_GenericGetAttr((PyObject *) self, name);
+}
+
+
 static PyObject *
 Table_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
 {
     Table *self;
+    int omode = TDBOWRITER | TDBOCREAT;
+    char *path = NULL;
+    static char *kwlist[] = { "path", "omode", NULL };
     
     self = (Table *) type->tp_alloc(type, 0);
     if (!self)
@@ -460,6 +1592,8 @@ Table_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         return NULL;
     }
     
+    self->forkgen = table_forkgen;
+    
     self->db = tctdbnew();
     if (!self->db)
     {
@@ -467,7 +1601,29 @@ Table_new(PyTypeObject *type, PyObject *args, PyObject *kwargs)
         return NULL;
     }
     
-    return (PyObject *) self;
+    if (PyArg_ParseTupleAndKeywords(args, kwargs, "|si", kwlist, &path, &omode))
+    {
+        if (path)
+        {
+            bool success = 0;
+            Py_BEGIN_ALLOW_THREADS
+            success = tctdbopen(self->db, path, omode);
+            Py_END_ALLOW_THREADS
+            if (success)
+            {
+                Table_setopened(self, path, omode);
+                return (PyObject *) self;
+            }
+            raise_table_error(self->db);
+        }
+        else
+        {
+            return (PyObject *) self;
+        }
+    }
+    
+    Table_dealloc(self);
+    return NULL;
 }
 
 
@@ -483,6 +1639,27 @@ Table_setmutex(Table *self)
         raise_table_error(self->db);
         return NULL;
     }
+    self->mutex = true;
+    Py_RETURN_NONE;
+}
+
+
+static PyObject *
+Table_setlazy(Table *self, PyObject *args)
+{
+    PyObject *enable = Py_True;
+    int rv;
+    
+    if (!PyArg_ParseTuple(args, "|O:setlazy", &enable))
+    {
+        return NULL;
+    }
+    
+    if ((rv = PyObject_IsTrue(enable)) < 0)
+    {
+        return NULL;
+    }
+    self->lazy = rv != 0;
     Py_RETURN_NONE;
 }
 
@@ -547,6 +1724,9 @@ Table_setcache(Table *self, PyObject *args, PyObject *kwargs)
         raise_table_error(self->db);
         return NULL;
     }
+    self->rcnum = rcnum;
+    self->lcnum = lcnum;
+    self->ncnum = ncnum;
     Py_RETURN_NONE;
 }
 
@@ -571,6 +1751,7 @@ Table_setxmsize(Table *self, PyObject *args)
         raise_table_error(self->db);
         return NULL;
     }
+    self->xmsiz = xmsiz;
     Py_RETURN_NONE;
 }
 
@@ -614,6 +1795,7 @@ Table_open(Table *self, PyObject *args, PyObject *kwargs)
         Py_END_ALLOW_THREADS
         if (success)
         {
+            Table_setopened(self, path, omode);
             Py_RETURN_NONE;
         }
         raise_table_error(self->db);
@@ -634,6 +1816,7 @@ Table_close(Table *self)
         raise_table_error(self->db);
         return NULL;
     }
+    Table_setopened(self, NULL, 0);
     Py_RETURN_NONE;
 }
 
@@ -773,14 +1956,24 @@ Table_out(Table *self, PyObject *args)
 
 
 static PyObject *
-Table_get(Table *self, PyObject *args)
+Table_get(Table *self, PyObject *args, PyObject *kwargs)
 {
     char *kbuf;
-    int ksiz;
+    int ksiz, as_tuple = 0;
+    bool lazy;
     TCMAP *cols;
-    PyObject *value;
+    PyObject *columns = NULL, *lazyobj = NULL, *fast, *value;
+    
+    static char *kwlist[] = {"key", "columns", "as_tuple", "lazy", NULL};
+    
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s#|OiO:get", kwlist,
+        &kbuf, &ksiz, &columns, &as_tuple, &lazyobj))
+    {
+        return NULL;
+    }
     
-    if (!PyArg_ParseTuple(args, "s#:get", &kbuf, &ksiz))
+    if (table_parselazy(self, lazyobj, &lazy) ||
+        table_parsecolumns(columns, as_tuple, &fast))
     {
         return NULL;
     }
@@ -791,18 +1984,131 @@ Table_get(Table *self, PyObject *args)
     
     if (!cols)
     {
+        Py_XDECREF(fast);
         Py_RETURN_NONE;
     }
     
-    value = tcmap2pydict(cols);
-    tcmapdel(cols);
+    value = table_convert(cols, fast, as_tuple != 0, lazy);
+    Py_XDECREF(fast);
+    
+    return value;
+}
+
+
+/*
+ * Fetch a batch of records with the GIL released once for all of them, and
+ * return them in key order with default for those missing. The keys are
+ * copied first, since the caller's list may change while the GIL is released.
+ */
+static PyObject *
+Table_getmany(Table *self, PyObject *args, PyObject *kwargs)
+{
+    PyObject *keys, *columns = NULL, *default_value = Py_None, *lazyobj = NULL;
+    PyObject *kfast, *fast, *result, *value;
+    Py_ssize_t i, n;
+    int as_tuple = 0;
+    bool lazy;
+    TCMAP **recs;
+    TCLIST *klist;
+    const char *kbuf;
+    int ksiz;
+    
+    static char *kwlist[] = {"keys", "columns", "as_tuple", "default", "lazy", NULL};
     
-    if (!value)
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OiOO:getmany", kwlist,
+        &keys, &columns, &as_tuple, &default_value, &lazyobj))
     {
         return NULL;
     }
     
-    return value;
+    if (table_parselazy(self, lazyobj, &lazy))
+    {
+        return NULL;
+    }
+    
+    kfast = PySequence_Fast(keys, "Expected keys to be a sequence of strings.");
+    if (kfast == NULL)
+    {
+        return NULL;
+    }
+    
+    if (table_parsecolumns(columns, as_tuple, &fast))
+    {
+        Py_DECREF(kfast);
+        return NULL;
+    }
+    
+    n = PySequence_Fast_GET_SIZE(kfast);
+    recs = (TCMAP **) calloc(n + 1, sizeof(TCMAP *));
+    klist = tclistnew2(n + 1);
+    if (!recs || !klist)
+    {
+        free(recs);
+        if (klist)
+        {
+            tclistdel(klist);
+        }
+        Py_DECREF(kfast);
+        Py_XDECREF(fast);
+        return PyErr_NoMemory();
+    }
+    
+    result = NULL;
+    for (i=0; i<n; i++)
+    {
+        PyObject *key = PySequence_Fast_GET_ITEM(kfast, i);
+        
+        if (!PyString_Check(key))
+        {
+            PyErr_SetString(PyExc_TypeError, "Expected keys to be a sequence of strings.");
+            goto done;
+        }
+        tclistpush(klist, PyString_AS_STRING(key), (int) PyString_GET_SIZE(key));
+    }
+    
+    Py_BEGIN_ALLOW_THREADS
+    for (i=0; i<n; i++)
+    {
+        kbuf = tclistval(klist, (int) i, &ksiz);
+        recs[i] = tctdbget(self->db, kbuf, ksiz);
+    }
+    Py_END_ALLOW_THREADS
+    
+    result = PyList_New(n);
+    for (i=0; result && i<n; i++)
+    {
+        if (recs[i])
+        {
+            value = table_convert(recs[i], fast, as_tuple != 0, lazy);
+            recs[i] = NULL;
+            if (value == NULL)
+            {
+                Py_CLEAR(result);
+                break;
+            }
+        }
+        else
+        {
+            Py_INCREF(default_value);
+            value = default_value;
+        }
+        PyList_SET_ITEM(result, i, value);
+    }
+    
+done:
+    for (i=0; i<n; i++)
+    {
+        if (recs[i])
+        {
+            tcmapdel(recs[i]);
+        }
+    }
+    free(recs);
+    tclistdel(klist);
+    Py_DECREF(kfast);
+    Py_XDECREF(fast);
+    
+    return result;
 }
 
 
@@ -828,6 +2134,10 @@ static PyObject *
 Table_iter(Table *self)
 {
     bool result;
+    if (Table_checkfork(self))
+    {
+        return NULL;
+    }
     Py_BEGIN_ALLOW_THREADS
     result = tctdbiterinit(self->db);
     Py_END_ALLOW_THREADS
@@ -1291,11 +2601,28 @@ Table_metasearch(Table *self, PyObject *args)
 }
 
 
+static PyObject *
+Table_reduce(Table *self)
+{
+    if (!self->path)
+    {
+        return Py_BuildValue("(O())", (PyObject *) self->ob_type);
+    }
+    return Py_BuildValue("(O(si))", (PyObject *) self->ob_type,
+        self->path, (self->omode & ~(TDBOWRITER | TDBOCREAT | TDBOTRUNC)) | TDBOREADER);
+}
+
+
 static int
 Table_length(Table *self)
 {
     uint64_t rnum;
     
+    if (Table_checkfork(self))
+    {
+        return -1;
+    }
+    
     Py_BEGIN_ALLOW_THREADS
     rnum = tctdbrnum(self->db);
     Py_END_ALLOW_THREADS
@@ -1310,7 +2637,11 @@ Table_subscript(Table *self, PyObject *key)
     char *kbuf;
     Py_ssize_t ksiz;
     TCMAP *cols;
-    PyObject *value;
+    
+    if (Table_checkfork(self))
+    {
+        return NULL;
+    }
     
     if (!PyString_Check(key))
     {
@@ -1328,15 +2659,7 @@ Table_subscript(Table *self, PyObject *key)
         Py_RETURN_NONE;
     }
     
-    value = tcmap2pydict(cols);
-    tcmapdel(cols);
-    
-    if (!value)
-    {
-        return NULL;
-    }
-    
-    return value;
+    return table_convert(cols, NULL, false, self->lazy);
 }
 
 
@@ -1348,6 +2671,11 @@ Table_ass_subscript(Table *self, PyObject *key, PyObject *value)
     Py_ssize_t ksiz;
     TCMAP *cols;
     
+    if (Table_checkfork(self))
+    {
+        return -1;
+    }
+    
     if (!PyString_Check(key))
     {
         PyErr_SetString(PyExc_TypeError, "Expected key to be a string.");
@@ -1397,6 +2725,11 @@ Table_contains(Table *self, PyObject *value)
     Py_ssize_t ksiz;
     Py_ssize_t vsiz;
     
+    if (Table_checkfork(self))
+    {
+        return -1;
+    }
+    
     if (!PyString_Check(value))
     {
         PyErr_SetString(PyExc_ValueError, "Expected value to be a string");
@@ -1440,6 +2773,12 @@ static PyMethodDef Table_methods[] =
         "Set the mutual exclusion control of the database for threading."
     },
     
+    {
+        "setlazy", (PyCFunction) Table_setlazy,
+        METH_VARARGS,
+        "Make reads return Record views instead of dicts unless told otherwise."
+    },
+    
     {
         "tune", (PyCFunction) Table_tune,
         METH_VARARGS | METH_KEYWORDS,
@@ -1502,8 +2841,14 @@ static PyMethodDef Table_methods[] =
     
     {
         "get", (PyCFunction) Table_get,
-        METH_VARARGS,
-        "Retrieve a record. If none is found None or the supplied default value is returned."
+        METH_VARARGS | METH_KEYWORDS,
+        "Retrieve a record, or only the given columns of it. If none is found None is returned."
+    },
+    
+    {
+        "getmany", (PyCFunction) Table_getmany,
+        METH_VARARGS | METH_KEYWORDS,
+        "Retrieve a list of records, or only the given columns of them, with default for missing keys."
     },
     
     {
@@ -1614,6 +2959,12 @@ static PyMethodDef Table_methods[] =
         "Use multiple query objects and a set operation to retrieve records."
     },
     
+    {
+        "__reduce__", (PyCFunction) Table_reduce,
+        METH_NOARGS,
+        "Pickle the handle as its path and open mode."
+    },
+    
     { NULL }
 };
 
@@ -1636,7 +2987,7 @@ static PyTypeObject TableType = {
   Table_Hash,                                  /* tp_hash  */
   0,                                           /* tp_call */
   0,                                           /* tp_str */
-  0,                                           /* tp_getattro */
+  (getattrofunc)Table_getattro,                /* tp_getattro */
   0,                                           /* tp_setattro */
   0,                                           /* tp_as_buffer */
   Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,    /* tp_flags */
@@ -1695,6 +3046,18 @@ inittable(void)
         return;
     }
     
+    if (PyType_Ready(&RecordType) < 0)
+    {
+        return;
+    }
+    
+    if (PyType_Ready(&TableQueryIterType) < 0)
+    {
+        return;
+    }
+    
+    pthread_atfork(NULL, NULL, table_atfork_child);
+    
     
     Py_INCREF(&TableType);
     PyModule_AddObject(m, "Table", (PyObject *) &TableType);
@@ -1702,6 +3065,9 @@ inittable(void)
     Py_INCREF(&TableQueryType);
     PyModule_AddObject(m, "TableQuery", (PyObject *) &TableQueryType);
     
+    Py_INCREF(&RecordType);
+    PyModule_AddObject(m, "Record", (PyObject *) &RecordType);
+    
     ADD_INT_CONSTANT(m, TDBOREADER);
     ADD_INT_CONSTANT(m, TDBOWRITER);
     ADD_INT_CONSTANT(m, TDBOCREAT);
@@ -0,0 +1,174 @@
+"""Time series stored in a B+ tree database.
+
+Each point is a record keyed by ``keycodec.pack((series, timestamp))``. The
+series id comes first and the timestamp is a big-endian 64-bit integer, so
+the default lexical comparator keeps every series together and in time
+order. Reading a time window is then a single range scan, and expiring old
+points is a single range delete per series.
+"""
+
+from tokyocabinet import btree, keycodec
+
+
+class TimeSeries(object):
+    """Points of any number of series in one ``BTree`` file.
+
+    ``series`` ids may be strings or integers and timestamps are integers in
+    whatever unit the caller picks. Values are strings, as everywhere else in
+    Tokyo Cabinet; use ``value_type='double'`` etc. in ``downsample`` if they
+    were written in binary form.
+
+    New points are expected in time order for each series. They always land
+    at the end of the series' key range, so the file is tuned with larger
+    pages than usual. That does not change how full pages end up (Tokyo
+    Cabinet splits a full page in the middle, so in-order appends leave
+    pages about half full either way), but it means fewer splits while
+    appending and a shallower tree for window reads.
+
+    ``retention``, when given, is the age (in timestamp units) beyond which
+    ``expire()`` drops points if no cutoff is passed.
+    """
+
+    LMEMB = 256
+    NMEMB = 512
+
+    def __init__(self, path, omode=btree.BDBOWRITER | btree.BDBOCREAT,
+                 retention=None):
+        self.retention = retention
+        self.db = btree.BTree()
+        # Tuning only applies when the file is created.
+        self.db.tune(lmemb=self.LMEMB, nmemb=self.NMEMB)
+        self.db.open(path, omode)
+        self._last = {}
+
+    def close(self):
+        self.db.close()
+
+    def sync(self):
+        self.db.sync()
+
+    def _latest_ts(self, series):
+        if series not in self._last:
+            start, stop = keycodec.prefix_range((series,))
+            for key in self.db.irange(start, stop, reverse=True, batch=1,
+                                      keys_only=True):
+                self._last[series] = keycodec.unpack(key)[1]
+                break
+            else:
+                self._last[series] = None
+        return self._last[series]
+
+    def append(self, series, ts, value):
+        """Add a point at or after the newest one of its series."""
+        last = self._latest_ts(series)
+        if last is not None and ts < last:
+            raise ValueError("Timestamp %r is older than the newest point "
+                             "(%r) of series %r." % (ts, last, series))
+        self.db.putdup(keycodec.pack((series, ts)), value)
+        self._last[series] = ts
+
+    def extend(self, series, points):
+        """Append an iterable of (timestamp, value) pairs to one series."""
+        for ts, value in points:
+            self.append(series, ts, value)
+
+    def _bounds(self, series, t0, t1):
+        start, stop = keycodec.prefix_range((series,))
+        if t0 is not None:
+            start = keycodec.pack((series, t0))
+        if t1 is not None:
+            stop = keycodec.pack((series, t1))
+        return start, stop
+
+    def window(self, series, t0=None, t1=None, reverse=False, batch=100):
+        """Iterate over the (timestamp, value) points with t0 <= ts < t1.
+
+        Either end may be ``None`` to leave it open.
+        """
+        start, stop = self._bounds(series, t0, t1)
+        for key, value in self.db.irange(start, stop, reverse=reverse,
+                                         batch=batch):
+            yield keycodec.unpack(key)[1], value
+
+    def latest(self, series, n=1):
+        """Get the newest n points of a series, newest first."""
+        points = []
+        for point in self.window(series, reverse=True, batch=n):
+            points.append(point)
+            if len(points) == n:
+                break
+        return points
+
+    def count(self, series, t0=None, t1=None):
+        start, stop = self._bounds(series, t0, t1)
+        return self.db.count_range(start, stop)
+
+    def downsample(self, series, t0, t1, bucket, fn='avg',
+                   value_type='decimal'):
+        """Aggregate the points of [t0, t1) in buckets of the given width.
+
+        Returns (bucket start, result) pairs for the buckets holding any
+        points. ``fn`` and ``value_type`` are as for ``BTree.aggregate``,
+        which computes each bucket natively. Empty buckets cost nothing:
+        each step jumps to the bucket of the next stored point.
+        """
+        if bucket <= 0:
+            raise ValueError("Expected bucket to be positive.")
+
+        fns = (fn,) if isinstance(fn, basestring) else tuple(fn)
+        points = []
+        b = t0
+        while b < t1:
+            start, stop = self._bounds(series, b, t1)
+            key = None
+            for key in self.db.irange(start, stop, batch=1, keys_only=True):
+                break
+            if key is None:
+                break
+            ts = keycodec.unpack(key)[1]
+            b += (ts - b) // bucket * bucket
+
+            start, stop = self._bounds(series, b, min(b + bucket, t1))
+            result = self.db.aggregate(start, stop, fns, value_type)
+            if isinstance(fn, basestring):
+                points.append((b, result[fn]))
+            else:
+                points.append((b, dict((f, result[f]) for f in fns)))
+            b += bucket
+        return points
+
+    def series(self):
+        """Iterate over the ids of every stored series."""
+        start = None
+        while True:
+            key = None
+            for key in self.db.irange(start, batch=1, keys_only=True):
+                break
+            if key is None:
+                return
+            sid = keycodec.unpack(key)[0]
+            yield sid
+            start = keycodec.prefix_range((sid,))[1]
+
+    def expire(self, before=None, series=None, chunk=1000):
+        """Delete the points older than ``before`` and return how many.
+
+        ``before`` defaults to the newest timestamp of each series minus
+        ``retention``. Without ``series`` every series is expired.
+        """
+        if before is None and self.retention is None:
+            raise ValueError("Expected a cutoff or a retention period.")
+
+        ids = [series] if series is not None else list(self.series())
+        removed = 0
+        for sid in ids:
+            cutoff = before
+            if cutoff is None:
+                last = self._latest_ts(sid)
+                if last is None:
+                    continue
+                cutoff = last - self.retention
+            start, stop = self._bounds(sid, None, cutoff)
+            removed += self.db.out_range(start, stop, chunk=chunk)
+            self._last.pop(sid, None)
+        return removed